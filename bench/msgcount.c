@@ -0,0 +1,83 @@
+// LD_PRELOAD shim used by swarm_bench.py: counts the point-to-point messages every rank
+// sends, through the MPI profiling interface, and prints the count at MPI_Finalize as
+// BENCH msgs <rank> <count>. A persistent send counts once per MPI_Start
+#include <stdio.h>
+#include <pthread.h>
+#include <mpi.h>
+
+#define MAX_PERSISTENT 1024
+
+static long sent;
+// the persistent send requests alive, so MPI_Start can tell them from the receives
+static MPI_Request persistent[MAX_PERSISTENT];
+static int persistentCount;
+static pthread_mutex_t persistentLock = PTHREAD_MUTEX_INITIALIZER;
+
+static int isPersistentSend(MPI_Request req, int remove)
+{
+    int found = 0;
+    pthread_mutex_lock(&persistentLock);
+    for (int i = 0; i < persistentCount; i++) {
+        if (persistent[i] == req) {
+            found = 1;
+            if (remove) {
+                persistent[i] = persistent[--persistentCount];
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&persistentLock);
+    return found;
+}
+
+int MPI_Send(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm)
+{
+    __atomic_fetch_add(&sent, 1, __ATOMIC_RELAXED);
+    return PMPI_Send(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Isend(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request *req)
+{
+    __atomic_fetch_add(&sent, 1, __ATOMIC_RELAXED);
+    return PMPI_Isend(buf, count, type, dest, tag, comm, req);
+}
+
+int MPI_Ssend(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm)
+{
+    __atomic_fetch_add(&sent, 1, __ATOMIC_RELAXED);
+    return PMPI_Ssend(buf, count, type, dest, tag, comm);
+}
+
+int MPI_Send_init(const void *buf, int count, MPI_Datatype type, int dest, int tag, MPI_Comm comm, MPI_Request *req)
+{
+    int rc = PMPI_Send_init(buf, count, type, dest, tag, comm, req);
+    pthread_mutex_lock(&persistentLock);
+    if (persistentCount < MAX_PERSISTENT) {
+        persistent[persistentCount++] = *req;
+    }
+    pthread_mutex_unlock(&persistentLock);
+    return rc;
+}
+
+int MPI_Start(MPI_Request *req)
+{
+    if (isPersistentSend(*req, 0)) {
+        __atomic_fetch_add(&sent, 1, __ATOMIC_RELAXED);
+    }
+    return PMPI_Start(req);
+}
+
+int MPI_Request_free(MPI_Request *req)
+{
+    isPersistentSend(*req, 1);
+    return PMPI_Request_free(req);
+}
+
+int MPI_Finalize(void)
+{
+    int rank;
+    PMPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    printf("BENCH msgs %d %ld\n", rank, sent);
+    fflush(stdout);
+    return PMPI_Finalize();
+}
@@ -0,0 +1,376 @@
+#!/usr/bin/env python3
+"""Swarm benchmark for tema2.
+
+Generates synthetic in<R>.txt workloads, runs them with mpirun at several rank
+counts (oversubscribed on one machine is fine) and reports, per rank count:
+
+  first_seed   time until the first downloaded file is complete (a new seed)
+  client_avg   mean completion time of the clients that download something
+  client_max   completion time of the slowest client
+  swarm        time until the tracker sends TAG_FINISH
+  msgs/seg     point-to-point messages of all ranks per downloaded segment
+
+Times are seconds from the first rank start. The numbers come from the
+TEMA2_BENCH=1 events of tema2 and from msgcount.c, preloaded to count the
+messages. Every run is also checked: each client<R>_<file> must hold the
+right hashes.
+
+  python3 bench/swarm_bench.py --ranks 4,8,16,32,64 --files 20 --skew 1.2
+  python3 bench/swarm_bench.py --env TEMA2_WEIGHTED_SOURCES=0 --json cyclic.json
+  python3 bench/swarm_bench.py --ranks 34,66 --trackers 2
+  python3 bench/swarm_bench.py generate DIR --clients 8 --files 10
+  python3 bench/swarm_bench.py check
+
+check runs the regression cases below on small fixed inputs (tema2 with
+mpirun, or bench/swarm_sim.c) and prints ok or FAIL for each.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import re
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, "..", "tema2.c")
+SHIM = os.path.join(HERE, "msgcount.c")
+SIM = os.path.join(HERE, "swarm_sim.c")
+
+
+def source_limits(source):
+    """MAX_FILES / MAX_CHUNKS of tema2.c, None when the source has no such limit."""
+    limits = {"MAX_FILES": None, "MAX_CHUNKS": None}
+    with open(source) as f:
+        text = f.read()
+    for name in limits:
+        m = re.search(r"#define\s+%s\s+(\d+)" % name, text)
+        if m:
+            limits[name] = int(m.group(1))
+    return limits
+
+
+def generate(out_dir, clients, files, segments, seed_ratio, replicas, skew, wants, rng_seed, limits, first=1):
+    """Write in<first>.txt .. in<first + clients - 1>.txt and return the expected client outputs.
+
+    The ranks before `first` are trackers. The first max(1, clients * seed_ratio) clients
+    are the initial seeds, every file
+    is owned by `replicas` of them. The other clients are leechers that want `wants`
+    files each, drawn with Zipf(skew) popularity (file1 is the most popular).
+    """
+    rng = random.Random(rng_seed)
+    num_seeds = max(1, min(clients, round(clients * seed_ratio)))
+    replicas = min(replicas, num_seeds)
+    names = ["file%d" % (i + 1) for i in range(files)]
+    hashes = {}
+    for i, name in enumerate(names):
+        count = rng.randint(max(1, segments // 2), segments)
+        hashes[name] = [hashlib.md5(("%d-%d-%d" % (rng_seed, i, s)).encode()).hexdigest() for s in range(count)]
+
+    ranks = range(first, first + clients)
+    have = {r: [] for r in ranks}
+    for i, name in enumerate(names):
+        for k in range(replicas):
+            have[first + (i + k) % num_seeds].append(name)
+
+    weights = [1.0 / (i + 1) ** skew for i in range(files)]
+    want = {r: [] for r in ranks}
+    for r in ranks[num_seeds:]:
+        pool = list(range(files))
+        w = list(weights)
+        while pool and len(want[r]) < wants:
+            k = rng.choices(range(len(pool)), weights=w)[0]
+            want[r].append(names[pool.pop(k)])
+            w.pop(k)
+
+    max_files = limits.get("MAX_FILES")
+    max_chunks = limits.get("MAX_CHUNKS")
+    for r in ranks:
+        if max_files is not None and len(have[r]) + len(want[r]) > max_files:
+            sys.exit("client %d would hold %d files, tema2.c allows MAX_FILES=%d"
+                     % (r, len(have[r]) + len(want[r]), max_files))
+    if max_chunks is not None and segments > max_chunks:
+        sys.exit("--segments %d is above MAX_CHUNKS=%d of tema2.c" % (segments, max_chunks))
+
+    os.makedirs(out_dir, exist_ok=True)
+    for r in ranks:
+        with open(os.path.join(out_dir, "in%d.txt" % r), "w") as f:
+            f.write("%d\n" % len(have[r]))
+            for name in have[r]:
+                f.write("%s %d\n" % (name, len(hashes[name])))
+                for h in hashes[name]:
+                    f.write(h + "\n")
+            f.write("%d\n" % len(want[r]))
+            for name in want[r]:
+                f.write(name + "\n")
+    return {"client%d_%s" % (r, name): hashes[name] for r in want for name in want[r]}
+
+
+def build(build_dir, source, mpicc):
+    binary = os.path.join(build_dir, "tema2")
+    shim = os.path.join(build_dir, "libmsgcount.so")
+    subprocess.run([mpicc, "-O2", "-o", binary, source, "-lpthread"], check=True)
+    subprocess.run([mpicc, "-O2", "-shared", "-fPIC", "-o", shim, SHIM], check=True)
+    return binary, shim
+
+
+def run_once(binary, shim, work_dir, ranks, env, mpirun, timeout):
+    cmd = [mpirun, "--oversubscribe", "-np", str(ranks)]
+    if hasattr(os, "geteuid") and os.geteuid() == 0:
+        cmd.insert(1, "--allow-run-as-root")
+    run_env = dict(os.environ)
+    run_env.update(env)
+    run_env["TEMA2_BENCH"] = "1"
+    run_env["LD_PRELOAD"] = shim
+    for key in sorted(set(env) | {"TEMA2_BENCH", "LD_PRELOAD"}):
+        cmd += ["-x", key]
+    cmd.append(binary)
+    proc = subprocess.run(cmd, cwd=work_dir, env=run_env, stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT, universal_newlines=True, timeout=timeout)
+    return proc.returncode, proc.stdout
+
+
+def parse_events(output):
+    events = []
+    msgs = {}
+    for line in output.splitlines():
+        parts = line.split()
+        if len(parts) >= 4 and parts[0] == "BENCH":
+            if parts[1] == "msgs":
+                msgs[int(parts[2])] = int(parts[3])
+            elif len(parts) >= 5:
+                events.append((parts[1], int(parts[2]), float(parts[3]), parts[4]))
+    return events, msgs
+
+
+def check_outputs(work_dir, expected):
+    bad = []
+    for name, hashes in expected.items():
+        path = os.path.join(work_dir, name)
+        try:
+            with open(path) as f:
+                got = f.read().split()
+        except OSError:
+            got = None
+        if got != hashes:
+            bad.append(name)
+    return bad
+
+
+def measure(events, msgs, expected):
+    starts = [t for e, _, t, _ in events if e == "start"]
+    if not starts:
+        return None
+    t0 = min(starts)
+    file_done = [t - t0 for e, _, t, _ in events if e == "file_done"]
+    leechers = {name.split("_", 1)[0][len("client"):] for name in expected}
+    done = {r: t - t0 for e, r, t, _ in events if e == "all_done"}
+    clients = [done[r] for r in done if str(r) in leechers]
+    # every tracker prints it, the swarm ends with the last one
+    finish = [t - t0 for e, _, t, _ in events if e == "finish"]
+    segments = sum(len(h) for h in expected.values())
+    return {
+        "first_seed": min(file_done) if file_done else None,
+        "client_avg": statistics.mean(clients) if clients else None,
+        "client_max": max(clients) if clients else None,
+        "clients": {str(r): done[r] for r in sorted(done)},
+        "swarm": max(finish) if finish else None,
+        "msgs": sum(msgs.values()),
+        "msgs_per_segment": sum(msgs.values()) / segments if segments and msgs else None,
+    }
+
+
+def median(values):
+    values = [v for v in values if v is not None]
+    return statistics.median(values) if values else None
+
+
+def fmt(value, pattern="%.3f"):
+    return "-" if value is None else pattern % value
+
+
+def bench(args):
+    env = dict(kv.split("=", 1) for kv in args.env)
+    if args.trackers > 1:
+        env["TEMA2_TRACKERS"] = str(args.trackers)
+    limits = source_limits(args.source)
+    build_dir = tempfile.mkdtemp(prefix="tema2_bench_build_")
+    binary, shim = build(build_dir, args.source, args.mpicc)
+    report = {"env": env, "params": vars(args).copy(), "runs": []}
+    report["params"].pop("func", None)
+    print("%6s %8s %10s %10s %10s %10s %9s  %s" % ("ranks", "repeat", "first_seed", "client_avg",
+                                                  "client_max", "swarm", "msgs/seg", "check"))
+    failed = False
+    for ranks in [int(r) for r in args.ranks.split(",")]:
+        clients = ranks - args.trackers
+        results = []
+        for rep in range(args.repeat):
+            work_dir = tempfile.mkdtemp(prefix="tema2_bench_run_")
+            expected = generate(work_dir, clients, args.files, args.segments, args.seed_ratio,
+                                args.replicas, args.skew, args.wants, args.rng_seed + rep, limits, args.trackers)
+            try:
+                rc, output = run_once(binary, shim, work_dir, ranks, env, args.mpirun, args.timeout)
+            except subprocess.TimeoutExpired:
+                rc, output = "timeout", ""
+            events, msgs = parse_events(output)
+            bad = check_outputs(work_dir, expected)
+            result = measure(events, msgs, expected) or {}
+            result.update({"ranks": ranks, "repeat": rep, "rc": rc, "bad_outputs": bad})
+            results.append(result)
+            report["runs"].append(result)
+            if rc != 0 or bad:
+                failed = True
+                sys.stderr.write("ranks=%d repeat=%d rc=%s bad=%s\n%s\n" % (ranks, rep, rc, bad, output[-2000:]))
+            if args.keep:
+                dest = os.path.join(args.keep, "np%d_r%d" % (ranks, rep))
+                shutil.rmtree(dest, ignore_errors=True)
+                shutil.copytree(work_dir, dest)
+                with open(os.path.join(dest, "output.txt"), "w") as f:
+                    f.write(output)
+            shutil.rmtree(work_dir, ignore_errors=True)
+        ok = all(r["rc"] == 0 and not r["bad_outputs"] for r in results)
+        print("%6d %8s %10s %10s %10s %10s %9s  %s" % (
+            ranks, "med/%d" % len(results),
+            fmt(median(r.get("first_seed") for r in results)),
+            fmt(median(r.get("client_avg") for r in results)),
+            fmt(median(r.get("client_max") for r in results)),
+            fmt(median(r.get("swarm") for r in results)),
+            fmt(median(r.get("msgs_per_segment") for r in results), "%.2f"),
+            "ok" if ok else "FAIL"))
+    shutil.rmtree(build_dir, ignore_errors=True)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(report, f, indent=2)
+    return 1 if failed else 0
+
+
+def write_inputs(work_dir, clients):
+    """in<R>.txt for every rank R of clients, which maps to (owned {name: hashes}, wanted [names])."""
+    for r, (have, want) in clients.items():
+        with open(os.path.join(work_dir, "in%d.txt" % r), "w") as f:
+            f.write("%d\n" % len(have))
+            for name, hashes in have.items():
+                f.write("%s %d\n" % (name, len(hashes)))
+                for h in hashes:
+                    f.write(h + "\n")
+            f.write("%d\n" % len(want))
+            for name in want:
+                f.write(name + "\n")
+
+
+def run_sim(sim, work_dir, extra):
+    """The summary row of swarm_sim (first_seed .. incomplete) as a dict."""
+    proc = subprocess.run([sim, work_dir] + extra, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                          universal_newlines=True, timeout=60)
+    lines = proc.stdout.splitlines()
+    for i, line in enumerate(lines[:-1]):
+        if line.split()[:1] == ["first_seed"]:
+            return dict(zip(line.split(), lines[i + 1].split()))
+    return {}
+
+
+def case_bad_holder(tools, work_dir):
+    """Two seeds of a file, rank 1 gives bad copies: the leecher must still get all of it from rank 2."""
+    hashes = [hashlib.md5(b"bad-%d" % s).hexdigest() for s in range(80)]
+    write_inputs(work_dir, {1: ({"fileA": hashes}, []), 2: ({"fileA": hashes}, []), 3: ({}, ["fileA"])})
+    for batch in (1, 4):
+        os.environ["TEMA2_BATCH"] = str(batch)
+        row = run_sim(tools["sim"], work_dir, ["--bad-rank", "1"])
+        if row.get("incomplete") != "0":
+            return "TEMA2_BATCH=%d: %s" % (batch, row or "no summary")
+    return None
+
+
+def case_upper_hashes(tools, work_dir):
+    """Seeds with an uppercase and a lowercase file: the downloads must copy each one's hashes as written."""
+    upper = [hashlib.md5(b"up-%d" % s).hexdigest().upper() for s in range(40)]
+    lower = [hashlib.md5(b"low-%d" % s).hexdigest() for s in range(40)]
+    write_inputs(work_dir, {1: ({"fileA": upper}, []), 2: ({"fileB": lower}, []), 3: ({}, ["fileA", "fileB"])})
+    rc, output = run_once(tools["tema2"], tools["shim"], work_dir, 4, {}, tools["mpirun"], 60)
+    bad = check_outputs(work_dir, {"client3_fileA": upper, "client3_fileB": lower})
+    if rc != 0 or bad:
+        return "rc=%s bad=%s" % (rc, bad)
+    return None
+
+
+CASES = [case_bad_holder, case_upper_hashes]
+
+
+def check(args):
+    build_dir = tempfile.mkdtemp(prefix="tema2_check_build_")
+    binary, shim = build(build_dir, args.source, args.mpicc)
+    sim = os.path.join(build_dir, "swarm_sim")
+    subprocess.run([args.mpicc, "-O2", "-o", sim, SIM, "-lpthread"], check=True)
+    tools = {"tema2": binary, "shim": shim, "sim": sim, "mpirun": args.mpirun}
+    saved = dict(os.environ)
+    failed = False
+    for case in CASES:
+        work_dir = tempfile.mkdtemp(prefix="tema2_check_run_")
+        try:
+            error = case(tools, work_dir)
+        except subprocess.TimeoutExpired:
+            error = "timeout"
+        finally:
+            os.environ.clear()
+            os.environ.update(saved)
+        print("%-24s %s" % (case.__name__[len("case_"):], "ok" if error is None else "FAIL " + error))
+        failed |= error is not None
+        shutil.rmtree(work_dir, ignore_errors=True)
+    shutil.rmtree(build_dir, ignore_errors=True)
+    return 1 if failed else 0
+
+
+def generate_only(args):
+    generate(args.dir, args.clients, args.files, args.segments, args.seed_ratio, args.replicas,
+             args.skew, args.wants, args.rng_seed, source_limits(args.source), args.trackers)
+    return 0
+
+
+def add_workload_args(p):
+    p.add_argument("--files", type=int, default=8, help="number of distinct files")
+    p.add_argument("--segments", type=int, default=100, help="largest segment count of a file")
+    p.add_argument("--seed-ratio", type=float, default=0.25, help="share of clients that start as seeds")
+    p.add_argument("--replicas", type=int, default=1, help="initial seeds of every file")
+    p.add_argument("--skew", type=float, default=1.0, help="Zipf exponent of the file popularity, 0 is uniform")
+    p.add_argument("--wants", type=int, default=3, help="files wanted by every leecher")
+    p.add_argument("--rng-seed", type=int, default=1)
+    p.add_argument("--trackers", type=int, default=1, help="tracker ranks (TEMA2_TRACKERS), the clients come after them")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.set_defaults(func=bench)
+    add_workload_args(parser)
+    parser.add_argument("--ranks", default="4,8,16,32,64", help="comma separated MPI world sizes (tracker included)")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per rank count, the medians are reported")
+    parser.add_argument("--env", action="append", default=[], metavar="KEY=VALUE",
+                        help="environment for the ranks, e.g. TEMA2_WINDOW=16 (repeatable)")
+    parser.add_argument("--json", help="write every run to this file")
+    parser.add_argument("--keep", help="copy the inputs and outputs of every run under this directory")
+    parser.add_argument("--timeout", type=int, default=600, help="seconds allowed per run")
+    parser.add_argument("--source", default=SOURCE)
+    parser.add_argument("--mpicc", default="mpicc")
+    parser.add_argument("--mpirun", default="mpirun")
+
+    sub = parser.add_subparsers()
+    gen = sub.add_parser("generate", help="only write the in<R>.txt files of a workload")
+    gen.add_argument("dir")
+    gen.add_argument("--clients", type=int, required=True)
+    gen.add_argument("--source", default=SOURCE)
+    add_workload_args(gen)
+    gen.set_defaults(func=generate_only)
+    chk = sub.add_parser("check", help="run the regression cases")
+    chk.add_argument("--source", default=SOURCE)
+    chk.set_defaults(func=check)
+
+    args = parser.parse_args()
+    sys.exit(args.func(args))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,751 @@
+// Discrete-event simulator of a tema2 swarm, in one process and without any messages. It
+// includes tema2.c and runs its own logic on virtual ranks: the tracker catalog (catalogAdd,
+// addSeed, setPeerHave, packInfo, packDelta), the TAG_FILE_INFO handling of the clients
+// (initDownload, applySources, applyPush) and the choice of every request (pickDownload,
+// pickSegment, pickSource, claimRun). Time is virtual: a message takes --latency-us plus its
+// size over --bandwidth-mbps, the upload link of a client sends one answer at a time and a
+// tracker handles one message at a time, --tracker-us each. The TEMA2_ variables set the
+// knobs like for tema2 (TEMA2_WINDOW, TEMA2_BATCH, TEMA2_TRACKERS, TEMA2_PAYLOAD ...).
+//
+//   mpicc -O2 -o swarm_sim bench/swarm_sim.c -lpthread
+//   python3 bench/swarm_bench.py generate /tmp/w --clients 2000 --files 200
+//   ./swarm_sim /tmp/w [--latency-us 50] [--bandwidth-mbps 10000] [--tracker-us 5] [--service-us 5]
+//   ./swarm_sim /tmp/w --bad-rank R     R gives a bad copy of everything it is asked for
+//   ./swarm_sim --trace DIR     sums up the trace<R>.bin of a run built with -DTEMA2_TRACE
+//
+// Left out: endgame copies, PEX, choking, the one-sided mode, checkpoints and the CPU time of
+// the downloaders. Every client is registered before the first TAG_WANT_FILE
+#define main tema2Main
+#include "../tema2.c"
+#undef main
+
+#include <dirent.h>
+
+// what a virtual rank gets
+#define EV_TRACKER        0
+#define EV_INFO           1
+#define EV_PUSH           2
+#define EV_REQUEST        3
+#define EV_ANSWER         4
+
+#define FIRST_TAG         TAG_INIT_FILES
+#define LAST_TAG          TAG_PAYLOAD
+
+typedef struct {
+    double time;
+    // arrival order, breaks the ties
+    long seq;
+    int type;
+    // who handles it and who sent it
+    int rank;
+    int from;
+    int tag;
+    // requests and answers: the download of the requester and the asked run
+    int file;
+    int segment;
+    int count;
+    uint64_t granted;
+    // tracker messages and TAG_FILE_INFO: a malloc'd body
+    char* data;
+    int size;
+} Event;
+
+// TAG_WANT_UPDATE body
+typedef struct {
+    char filename[MAX_FILENAME + 1];
+    int since;
+    int seedsKnown;
+    unsigned char have[];
+} UpdateBody;
+
+// A client and its download thread
+typedef struct {
+    Client* c;
+    Download* downloads;
+    int count;
+    // TAG_FILE_INFO answers still expected before the downloads start
+    int infoLeft;
+    PendingRequest pending[MAX_WINDOW];
+    int inFlight;
+    SourceStats* stats;
+    unsigned int seed;
+    // download waiting for the answer of its swarm update, -1 if none; what arrives in the
+    // meantime waits too, like in updateSwarm
+    int updating;
+    Event* deferred;
+    int deferredCount;
+    int deferredCapacity;
+    // virtual time the downloads ended, -1 before
+    double doneAt;
+    int filesDone;
+} SimClient;
+
+typedef struct {
+    Event* heap;
+    int heapCount;
+    int heapCapacity;
+    long seq;
+    int numtasks;
+    Catalog* cats;
+    SimClient* clients;
+    // virtual time until which every rank's upload link (tracker: the tracker itself) is
+    // busy; a message is served in arrival order once it is free
+    double* busyUntil;
+    double latency;
+    // bytes per second
+    double bandwidth;
+    double trackerTime;
+    double serviceTime;
+    // --bad-rank: its copies all fail the check, every answer it gives is a "NO"; -1 if none
+    int badRank;
+    int batch;
+    long messages[LAST_TAG - FIRST_TAG + 1];
+    long bytes[LAST_TAG - FIRST_TAG + 1];
+    long segments;
+    long events;
+    double firstSeed;
+} Sim;
+
+static const char* tagNames[LAST_TAG - FIRST_TAG + 1] = {
+    "TAG_INIT_FILES", "TAG_INIT_ACK", "TAG_WANT_FILE", "TAG_FILE_INFO", "TAG_SEG_REQ", "TAG_SEG_RSP",
+    "TAG_FILE_DONE", "TAG_ALL_DONE", "TAG_FINISH", "TAG_WANT_UPDATE", "TAG_SHUTDOWN", "TAG_METRICS",
+    "TAG_SWARM_PUSH", "TAG_PAYLOAD"
+};
+
+static void heapPush(Sim* sim, Event* ev)
+{
+    if (sim->heapCount == sim->heapCapacity) {
+        sim->heapCapacity = sim->heapCapacity ? 2 * sim->heapCapacity : 1024;
+        sim->heap = (Event*)realloc(sim->heap, sim->heapCapacity * sizeof(Event));
+        DIE(sim->heap == NULL, "realloc() failed!\n");
+    }
+    ev->seq = sim->seq++;
+    int i = sim->heapCount++;
+    while (i > 0) {
+        Event* parent = &sim->heap[(i - 1) / 2];
+        if (parent->time < ev->time || (parent->time == ev->time && parent->seq < ev->seq)) {
+            break;
+        }
+        sim->heap[i] = *parent;
+        i = (i - 1) / 2;
+    }
+    sim->heap[i] = *ev;
+}
+
+static Event heapPop(Sim* sim)
+{
+    Event top = sim->heap[0];
+    Event last = sim->heap[--sim->heapCount];
+    int i = 0;
+    while (2 * i + 1 < sim->heapCount) {
+        int child = 2 * i + 1;
+        Event* a = &sim->heap[child];
+        Event* b = &sim->heap[child + 1];
+        if (child + 1 < sim->heapCount && (b->time < a->time || (b->time == a->time && b->seq < a->seq))) {
+            child++;
+        }
+        Event* c = &sim->heap[child];
+        if (last.time < c->time || (last.time == c->time && last.seq < c->seq)) {
+            break;
+        }
+        sim->heap[i] = *c;
+        i = child;
+    }
+    sim->heap[i] = last;
+    return top;
+}
+
+static void countMessage(Sim* sim, int tag, int bytes)
+{
+    sim->messages[tag - FIRST_TAG]++;
+    sim->bytes[tag - FIRST_TAG] += bytes;
+}
+
+// A message of size bytes leaving at virtual time at: it arrives after the latency and its
+// time on the wire
+static void sendAt(Sim* sim, double at, Event* ev, int bytes)
+{
+    countMessage(sim, ev->tag, bytes);
+    ev->time = at + sim->latency + bytes / sim->bandwidth;
+    heapPush(sim, ev);
+}
+
+static void sendTracker(Sim* sim, double now, int from, int tag, char* data, int size)
+{
+    Event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_TRACKER;
+    ev.rank = trackerOf(data);
+    ev.from = from;
+    ev.tag = tag;
+    ev.data = data;
+    ev.size = size;
+    sendAt(sim, now, &ev, size);
+}
+
+static void sendInfo(Sim* sim, double at, int dst, const char* info, int size)
+{
+    Event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EV_INFO;
+    ev.rank = dst;
+    ev.tag = TAG_FILE_INFO;
+    ev.data = (char*)malloc(size > 0 ? size : 1);
+    DIE(ev.data == NULL, "malloc() failed!\n");
+    memcpy(ev.data, info, size);
+    ev.size = size;
+    sendAt(sim, at, &ev, size);
+}
+
+// The tracker part: the same catalog updates as tracker(), the answers leave when the
+// tracker is done with the message
+static void trackerEvent(Sim* sim, Event* ev, double now)
+{
+    Catalog* cat = &sim->cats[ev->rank];
+    double at = (sim->busyUntil[ev->rank] > now ? sim->busyUntil[ev->rank] : now) + sim->trackerTime;
+    sim->busyUntil[ev->rank] = at;
+    int src = ev->from;
+    if (ev->tag == TAG_WANT_FILE) {
+        Tracker* t = catalogFind(cat, ev->data);
+        if (t == NULL) {
+            char buf[64];
+            int pos = 0;
+            int zero = 0;
+            MPI_Pack(ev->data, MAX_FILENAME + 1, MPI_CHAR, buf, sizeof(buf), &pos, MPI_COMM_WORLD);
+            MPI_Pack(&zero, 1, MPI_INT, buf, sizeof(buf), &pos, MPI_COMM_WORLD);
+            sendInfo(sim, at, src, buf, pos);
+            return;
+        }
+        if (t->info == NULL) {
+            packInfo(t);
+        }
+        sendInfo(sim, at, src, t->info, t->infoSize);
+        if (config.swarmPush) {
+            t->subscribed[src / 64] |= (uint64_t)1 << (src % 64);
+        }
+    } else if (ev->tag == TAG_WANT_UPDATE) {
+        UpdateBody* body = (UpdateBody*)ev->data;
+        Tracker* t = catalogFind(cat, body->filename);
+        DIE(t == NULL, "update for an unknown file\n");
+        if (setPeerHave(cat, t, src, body->have)) {
+            invalidateInfo(t);
+        }
+        int since = body->since;
+        int seedsKnown = body->seedsKnown;
+        if (seedsKnown < 0 || seedsKnown > t->seedCount) {
+            since = seedsKnown = 0;
+        }
+        int size = deltaSize(t, seedsKnown);
+        char* reply = (char*)malloc(size);
+        DIE(reply == NULL, "malloc() failed!\n");
+        int pos = 0;
+        packDelta(t, since, seedsKnown, src, reply, size, &pos);
+        sendInfo(sim, at, src, reply, pos);
+        free(reply);
+    } else if (ev->tag == TAG_FILE_DONE) {
+        Tracker* t = catalogFind(cat, ev->data);
+        if (t != NULL && addSeed(cat, t, src)) {
+            invalidateInfo(t);
+            t->subscribed[src / 64] &= ~((uint64_t)1 << (src % 64));
+            for (int w = 0; w < cat->setWords; w++) {
+                for (uint64_t bits = t->subscribed[w]; bits; bits &= bits - 1) {
+                    Event push;
+                    memset(&push, 0, sizeof(push));
+                    push.type = EV_PUSH;
+                    push.rank = w * 64 + __builtin_ctzll(bits);
+                    push.from = src;
+                    push.tag = TAG_SWARM_PUSH;
+                    push.segment = t->seedCount - 1;
+                    push.data = strdup(t->filename);
+                    sendAt(sim, at, &push, sizeof(SwarmPush));
+                }
+            }
+        }
+    }
+}
+
+// the upload side of ev->rank: the run it holds of the requester's file
+static void requestEvent(Sim* sim, Event* ev, double now)
+{
+    Client* c = sim->clients[ev->rank].c;
+    Download* want = &sim->clients[ev->from].downloads[ev->file];
+    uint64_t granted = 0;
+    for (int i = 0; i < c->numFilesHave; i++) {
+        File* f = &c->haveFiles[i];
+        if (strcmp(f->filename, want->info.filename) != 0) {
+            continue;
+        }
+        for (int k = 0; k < ev->count; k++) {
+            if (isPresent(f, ev->segment + k)) {
+                granted |= (uint64_t)1 << k;
+            }
+        }
+        break;
+    }
+    int data = __builtin_popcountll(granted) * config.payload;
+    // the answer (and the data) hold the link until they are sent
+    double start = sim->busyUntil[ev->rank] > now ? sim->busyUntil[ev->rank] : now;
+    double at = start + sim->serviceTime + (sizeof(SegResponse) + data) / sim->bandwidth;
+    sim->busyUntil[ev->rank] = at;
+    Event answer = *ev;
+    answer.type = EV_ANSWER;
+    answer.rank = ev->from;
+    answer.from = ev->rank;
+    answer.tag = TAG_SEG_RSP;
+    answer.granted = ev->rank == sim->badRank ? 0 : granted;
+    countMessage(sim, TAG_SEG_RSP, sizeof(SegResponse));
+    if (config.payload > 0) {
+        countMessage(sim, TAG_PAYLOAD, data);
+    }
+    answer.time = at + sim->latency;
+    heapPush(sim, &answer);
+}
+
+static void clientDone(Sim* sim, SimClient* s, double now)
+{
+    s->doneAt = now;
+    for (int k = 0; k < config.trackers; k++) {
+        countMessage(sim, TAG_FINISH, sizeof(int));
+    }
+    countMessage(sim, TAG_ALL_DONE, config.trackers * sizeof(int));
+}
+
+// The window fill of runDownloads (without the endgame copies and the choked sources)
+static void fillWindow(Sim* sim, SimClient* s, double now)
+{
+    if (s->doneAt >= 0 || s->infoLeft > 0 || s->updating >= 0) {
+        return;
+    }
+    for (int i = 0; i < config.requestWindow; i++) {
+        if (s->pending[i].segment != -1) {
+            continue;
+        }
+        int f = pickDownload(s->downloads, s->count, now);
+        if (f < 0) {
+            break;
+        }
+        Download* d = &s->downloads[f];
+        int segment = pickSegment(d);
+        if (segment < 0) {
+            d->blocked = 1;
+            i--;
+            continue;
+        }
+        int srank = pickSource(d, segment, s->stats, &s->seed, now);
+        if (srank < 0) {
+            // no choking here, only holders that refused it are left
+            d->failed = 1;
+            i--;
+            continue;
+        }
+        PendingRequest* p = &s->pending[i];
+        p->file = f;
+        p->count = claimRun(d, segment, srank, sim->batch, &p->segment);
+        p->srank = srank;
+        p->sentAt = now;
+        s->stats[srank].outstanding++;
+        s->inFlight++;
+        Event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.type = EV_REQUEST;
+        ev.rank = srank;
+        ev.from = s->c->rank;
+        ev.tag = TAG_SEG_REQ;
+        ev.file = f;
+        ev.segment = p->segment;
+        ev.count = p->count;
+        sendAt(sim, now, &ev, sizeof(SegRequest));
+    }
+    if (s->inFlight == 0) {
+        clientDone(sim, s, now);
+    }
+}
+
+// publish what we have of d, like updateSwarm; the client waits for the answer
+static void sendUpdate(Sim* sim, SimClient* s, int f, double now)
+{
+    Download* d = &s->downloads[f];
+    int bytes = bitfieldBytes(d->info.numSegments);
+    UpdateBody* body = (UpdateBody*)calloc(1, sizeof(UpdateBody) + bytes);
+    DIE(body == NULL, "calloc() failed!\n");
+    strcpy(body->filename, d->info.filename);
+    body->since = d->version;
+    body->seedsKnown = d->seedCount;
+    for (int seg = 0; seg < d->info.numSegments; seg++) {
+        if (d->state[seg] == SEG_DONE) {
+            bitSet(body->have, seg);
+        }
+    }
+    s->updating = f;
+    sendTracker(sim, now, s->c->rank, TAG_WANT_UPDATE, (char*)body, sizeof(UpdateBody) + bytes);
+}
+
+// An answer, handled like in runDownloads
+static void answerEvent(Sim* sim, SimClient* s, Event* ev, double now)
+{
+    Client* c = s->c;
+    PendingRequest* req = NULL;
+    for (int i = 0; i < config.requestWindow; i++) {
+        if (s->pending[i].segment == ev->segment && s->pending[i].file == ev->file && s->pending[i].srank == ev->from) {
+            req = &s->pending[i];
+            break;
+        }
+    }
+    DIE(req == NULL, "unmatched segment response");
+    s->inFlight--;
+    Download* d = &s->downloads[req->file];
+    uint64_t granted = ev->granted;
+    s->stats[req->srank].outstanding--;
+    recordAnswer(&s->stats[req->srank], now - req->sentAt, granted == 0, 0);
+    File* target = &c->haveFiles[d->haveIndex];
+    int before = d->received;
+    for (int k = 0; k < req->count; k++) {
+        int seg = req->segment + k;
+        if ((granted >> k) & 1) {
+            setPresent(target, seg);
+            d->state[seg] = SEG_DONE;
+            d->received++;
+            sim->segments++;
+        } else if (refuseSegment(d, seg, req->srank)) {
+            d->state[seg] = SEG_MISSING;
+            d->unasked++;
+            d->blocked = 0;
+        } else {
+            d->failed = 1;
+        }
+    }
+    req->segment = -1;
+    if (d->received > before) {
+        if (d->received == d->info.numSegments) {
+            s->filesDone++;
+            if (sim->firstSeed < 0) {
+                sim->firstSeed = now;
+            }
+            sendTracker(sim, now, c->rank, TAG_FILE_DONE, strdup(d->info.filename), MAX_FILENAME + 1);
+        } else if (config.swarmUpdate > 0 && d->received / config.swarmUpdate != before / config.swarmUpdate) {
+            sendUpdate(sim, s, req->file, now);
+            return;
+        }
+    }
+    fillWindow(sim, s, now);
+}
+
+static void defer(SimClient* s, Event* ev)
+{
+    if (s->deferredCount == s->deferredCapacity) {
+        s->deferredCapacity = s->deferredCapacity ? 2 * s->deferredCapacity : 16;
+        s->deferred = (Event*)realloc(s->deferred, s->deferredCapacity * sizeof(Event));
+        DIE(s->deferred == NULL, "realloc() failed!\n");
+    }
+    s->deferred[s->deferredCount++] = *ev;
+}
+
+// whether ev was just deferred, its body is freed when it is handled
+static int wasDeferred(SimClient* s, Event* ev)
+{
+    return s->deferredCount > 0 && s->deferred[s->deferredCount - 1].seq == ev->seq;
+}
+
+static void clientEvent(Sim* sim, Event* ev, double now)
+{
+    SimClient* s = &sim->clients[ev->rank];
+    Client* c = s->c;
+    if (ev->type == EV_INFO && s->infoLeft > 0) {
+        // the first answer for a wanted file, like the loop of download_thread_func
+        int pos = 0;
+        char name[MAX_FILENAME + 1];
+        int numSeg;
+        MPI_Unpack(ev->data, ev->size, &pos, name, MAX_FILENAME + 1, MPI_CHAR, MPI_COMM_WORLD);
+        name[MAX_FILENAME] = '\0';
+        MPI_Unpack(ev->data, ev->size, &pos, &numSeg, 1, MPI_INT, MPI_COMM_WORLD);
+        if (numSeg > 0) {
+            Download* d = &s->downloads[s->count++];
+            initDownload(c, d, name, numSeg, ev->data, ev->size, &pos);
+            d->haveIndex = c->numFilesHave;
+            c->haveFiles[d->haveIndex] = d->info;
+            c->numFilesHave++;
+        }
+        s->infoLeft--;
+        fillWindow(sim, s, now);
+        return;
+    }
+    if (s->updating >= 0) {
+        if (ev->type != EV_INFO) {
+            defer(s, ev);
+            return;
+        }
+        // the answer of the swarm update, then what came while waiting for it
+        int pos = 0;
+        applySources(&s->downloads[s->updating], ev->data, ev->size, &pos, c->rank);
+        s->updating = -1;
+        int count = s->deferredCount;
+        s->deferredCount = 0;
+        for (int i = 0; i < count && s->updating < 0; i++) {
+            Event later = s->deferred[i];
+            clientEvent(sim, &later, now);
+            free(later.data);
+            if (s->updating >= 0) {
+                // another update started, the rest waits again
+                for (int j = i + 1; j < count; j++) {
+                    defer(s, &s->deferred[j]);
+                }
+            }
+        }
+        fillWindow(sim, s, now);
+        return;
+    }
+    if (ev->type == EV_PUSH) {
+        if (s->doneAt < 0) {
+            SwarmPush push;
+            memset(&push, 0, sizeof(push));
+            strncpy(push.filename, ev->data, MAX_FILENAME);
+            push.index = ev->segment;
+            push.rank = ev->from;
+            applyPush(s->downloads, s->count, &push);
+            fillWindow(sim, s, now);
+        }
+    } else if (ev->type == EV_ANSWER) {
+        answerEvent(sim, s, ev, now);
+    }
+}
+
+static int fileExists(const char* name)
+{
+    struct stat sb;
+    return stat(name, &sb) == 0;
+}
+
+// Register every client's files with its trackers and send all the TAG_WANT_FILE, once
+// every TAG_INIT_FILES got its ACK
+static void startSwarm(Sim* sim)
+{
+    for (int r = config.trackers; r < sim->numtasks; r++) {
+        SimClient* s = &sim->clients[r];
+        Client* c = s->c;
+        for (int k = 0; k < config.trackers; k++) {
+            countMessage(sim, TAG_INIT_FILES, 0);
+            countMessage(sim, TAG_INIT_ACK, 4);
+        }
+        for (int i = 0; i < c->numFilesHave; i++) {
+            File* f = &c->haveFiles[i];
+            sim->bytes[TAG_INIT_FILES - FIRST_TAG] += manifestSize(f->numSegments);
+            Catalog* cat = &sim->cats[trackerOf(f->filename)];
+            Tracker* t = catalogFind(cat, f->filename);
+            if (t == NULL) {
+                t = catalogAdd(cat, f->filename, f->numSegments);
+            }
+            if (t->numSegments != f->numSegments) {
+                fprintf(stderr, "Client %d has %s with %d segments instead of %d\n", r, f->filename, f->numSegments, t->numSegments);
+                continue;
+            }
+            memcpy(t->digests, f->digests, (size_t)f->numSegments * DIGEST_SIZE);
+            t->upper = f->upper;
+            addSeed(cat, t, r);
+        }
+        for (int f = 0; f < c->numFilesWant; f++) {
+            char* name = (char*)calloc(MAX_FILENAME + 1, 1);
+            DIE(name == NULL, "calloc() failed!\n");
+            strncpy(name, c->wantFiles[f], MAX_FILENAME);
+            sendTracker(sim, 2 * sim->latency, r, TAG_WANT_FILE, name, MAX_FILENAME + 1);
+        }
+        if (s->infoLeft == 0) {
+            clientDone(sim, s, 2 * sim->latency);
+        }
+    }
+}
+
+static void printTags(const long* messages, const long* bytes)
+{
+    printf("%-16s %10s %14s\n", "tag", "messages", "bytes");
+    for (int t = 0; t <= LAST_TAG - FIRST_TAG; t++) {
+        if (messages[t] > 0) {
+            printf("%-16s %10ld %14ld\n", tagNames[t], messages[t], bytes[t]);
+        }
+    }
+}
+
+static void simulate(const char* dir, double latencyUs, double bandwidthMbps, double trackerUs, double serviceUs, int badRank)
+{
+    DIE(chdir(dir) < 0, "chdir() failed!\n");
+    Sim sim;
+    memset(&sim, 0, sizeof(sim));
+    sim.latency = latencyUs * 1e-6;
+    sim.bandwidth = bandwidthMbps * 1e6 / 8;
+    sim.trackerTime = trackerUs * 1e-6;
+    sim.serviceTime = serviceUs * 1e-6;
+    sim.badRank = badRank;
+    sim.firstSeed = -1;
+    sim.batch = config.batch;
+    if (config.payload > 0 && sim.batch > (1 << 30) / config.payload) {
+        sim.batch = (1 << 30) / config.payload;
+    }
+    // the clients are the consecutive in<R>.txt after the trackers
+    char name[64];
+    int numtasks = config.trackers;
+    for (;; numtasks++) {
+        snprintf(name, sizeof(name), "in%d.txt", numtasks);
+        if (!fileExists(name)) {
+            break;
+        }
+    }
+    DIE(numtasks == config.trackers, "no in<R>.txt for the clients\n");
+    sim.numtasks = numtasks;
+    sim.cats = (Catalog*)calloc(config.trackers, sizeof(Catalog));
+    sim.clients = (SimClient*)calloc(numtasks, sizeof(SimClient));
+    sim.busyUntil = (double*)calloc(numtasks, sizeof(double));
+    DIE(!sim.cats || !sim.clients || !sim.busyUntil, "calloc() failed!\n");
+    for (int k = 0; k < config.trackers; k++) {
+        catalogInit(&sim.cats[k], numtasks);
+    }
+    for (int r = config.trackers; r < numtasks; r++) {
+        SimClient* s = &sim.clients[r];
+        s->c = initClient(r);
+        DIE(s->c == NULL, "bad input file\n");
+        s->c->numtasks = numtasks;
+        s->downloads = (Download*)calloc(s->c->numFilesWant > 0 ? s->c->numFilesWant : 1, sizeof(Download));
+        s->stats = (SourceStats*)calloc(numtasks, sizeof(SourceStats));
+        DIE(s->downloads == NULL || s->stats == NULL, "calloc() failed!\n");
+        s->infoLeft = s->c->numFilesWant;
+        s->seed = (unsigned int)r;
+        s->updating = -1;
+        s->doneAt = -1;
+        for (int i = 0; i < MAX_WINDOW; i++) {
+            s->pending[i].segment = -1;
+        }
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    startSwarm(&sim);
+    double now = 0;
+    while (sim.heapCount > 0) {
+        Event ev = heapPop(&sim);
+        now = ev.time;
+        sim.events++;
+        if (ev.type == EV_TRACKER) {
+            trackerEvent(&sim, &ev, now);
+        } else if (ev.type == EV_REQUEST) {
+            requestEvent(&sim, &ev, now);
+        } else {
+            clientEvent(&sim, &ev, now);
+        }
+        if (ev.type == EV_TRACKER || !wasDeferred(&sim.clients[ev.rank], &ev)) {
+            free(ev.data);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    int downloaders = 0;
+    int incomplete = 0;
+    double sum = 0;
+    double last = 0;
+    for (int r = config.trackers; r < numtasks; r++) {
+        SimClient* s = &sim.clients[r];
+        if (s->c->numFilesWant == 0) {
+            continue;
+        }
+        downloaders++;
+        sum += s->doneAt;
+        last = s->doneAt > last ? s->doneAt : last;
+        incomplete += s->c->numFilesWant - s->filesDone;
+    }
+    long total = 0;
+    for (int t = 0; t <= LAST_TAG - FIRST_TAG; t++) {
+        total += t == TAG_PAYLOAD - FIRST_TAG ? 0 : sim.messages[t];
+    }
+    printf("ranks %d, %ld segments, %ld events in %.2fs\n", numtasks, sim.segments, sim.events,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    printf("%10s %10s %10s %10s %9s %11s\n", "first_seed", "client_avg", "client_max", "swarm", "msgs/seg", "incomplete");
+    printf("%10.4f %10.4f %10.4f %10.4f %9.2f %11d\n", sim.firstSeed, downloaders ? sum / downloaders : 0, last,
+           last + 2 * sim.latency, sim.segments ? (double)total / sim.segments : 0, incomplete);
+    printTags(sim.messages, sim.bytes);
+}
+
+// Sum up the trace<R>.bin files of dir: messages and bytes sent per tag, and how long the
+// traced run lasted
+static void traceSummary(const char* dir)
+{
+    DIR* dp = opendir(dir);
+    DIE(dp == NULL, "opendir() failed!\n");
+    long messages[LAST_TAG - FIRST_TAG + 1] = { 0 };
+    long bytes[LAST_TAG - FIRST_TAG + 1] = { 0 };
+    long records = 0;
+    int ranks = 0;
+    double first = 0;
+    double last = 0;
+    struct dirent* e;
+    while ((e = readdir(dp)) != NULL) {
+        int rank;
+        char tail;
+        if (sscanf(e->d_name, "trace%d.bi%c", &rank, &tail) != 2 || tail != 'n') {
+            continue;
+        }
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        FILE* in = fopen(path, "rb");
+        if (!in) {
+            continue;
+        }
+        ranks++;
+        TraceRecord rec;
+        while (fread(&rec, sizeof(rec), 1, in) == 1) {
+            records++;
+            first = first == 0 || rec.time < first ? rec.time : first;
+            last = rec.time > last ? rec.time : last;
+            if (rec.dir == 'S' && rec.tag >= FIRST_TAG && rec.tag <= LAST_TAG) {
+                messages[rec.tag - FIRST_TAG]++;
+                bytes[rec.tag - FIRST_TAG] += rec.bytes;
+            }
+        }
+        fclose(in);
+    }
+    closedir(dp);
+    printf("ranks %d, %ld records over %.4fs\n", ranks, records, last - first);
+    printTags(messages, bytes);
+}
+
+int main(int argc, char* argv[])
+{
+    // a singleton MPI process, only for MPI_Pack/MPI_Unpack of the shared code
+    MPI_Init(&argc, &argv);
+    loadConfig();
+    config.checkpoint = 0;
+    double latencyUs = 50;
+    double bandwidthMbps = 10000;
+    double trackerUs = 5;
+    double serviceUs = 5;
+    int badRank = -1;
+    const char* dir = NULL;
+    const char* trace = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--latency-us") == 0 && i + 1 < argc) {
+            latencyUs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--bandwidth-mbps") == 0 && i + 1 < argc) {
+            bandwidthMbps = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--tracker-us") == 0 && i + 1 < argc) {
+            trackerUs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--service-us") == 0 && i + 1 < argc) {
+            serviceUs = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--bad-rank") == 0 && i + 1 < argc) {
+            badRank = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (argv[i][0] != '-' && dir == NULL) {
+            dir = argv[i];
+        } else {
+            dir = NULL;
+            trace = NULL;
+            break;
+        }
+    }
+    if (trace) {
+        traceSummary(trace);
+    } else if (dir && bandwidthMbps > 0) {
+        simulate(dir, latencyUs, bandwidthMbps, trackerUs, serviceUs, badRank);
+    } else {
+        fprintf(stderr, "usage: %s DIR [--latency-us N] [--bandwidth-mbps N] [--tracker-us N] [--service-us N] [--bad-rank R]\n"
+                        "       %s --trace DIR\n", argv[0], argv[0]);
+    }
+    MPI_Finalize();
+    return 0;
+}
@@ -3,15 +3,64 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <mpi.h>
 
-#define LINE_SIZE         300
-#define MAX_CHUNKS        100
 #define TRACKER_RANK      0
-#define MAX_FILES         10
 #define MAX_FILENAME      15
 #define HASH_SIZE         32
-#define MAX_CLIENTS       20
+// a hash is read as HASH_SIZE hex digits and kept as a DIGEST_SIZE bytes digest
+#define DIGEST_SIZE       16
+// the letters of a hash (parseDigest), a file's hashes are written back in their case
+#define HEX_LOWER         1
+#define HEX_UPPER         2
+// default number of segment requests kept in flight by a downloader
+#define REQUEST_WINDOW    8
+#define MAX_WINDOW        64
+// default number of threads serving segment requests
+#define UPLOAD_WORKERS    2
+#define MAX_WORKERS       32
+// weight of a new sample in the moving averages of the source statistics
+#define STATS_ALPHA       0.2
+// default longest pause (microseconds) of an idle wait, 0 means plain MPI_Probe
+#define IDLE_MAX_US       1000
+// polls done before an idle wait starts sleeping
+#define IDLE_SPIN         64
+// largest segment payload (bytes) of the payload mode
+#define MAX_PAYLOAD       (64 * 1024 * 1024)
+// most tracker ranks of the sharded mode
+#define MAX_TRACKERS      64
+// size of the blocks the tracker catalog is carved from
+#define ARENA_BLOCK       (64 * 1024)
+// default number of sources gossiped with every segment answer (peer exchange)
+#define PEX_ENTRIES       4
+#define MAX_PEX           16
+// default number of downloaded segments of a file between two swarm updates
+#define SWARM_UPDATE      10
+// default number of missing segments of a file below which they are asked from more sources
+#define ENDGAME_SEGMENTS  8
+// most requests in flight for one segment in the endgame
+#define ENDGAME_COPIES    2
+// default number of consecutive segments asked with one request, the answer has a bit for each
+#define SEG_BATCH         16
+#define MAX_BATCH         64
+// default number of requesters an upload side serves at the same time (the last one is the
+// optimistic unchoke), 0 serves everybody
+#define UPLOAD_SLOTS      0
+// default time (microseconds) between two choke decisions
+#define CHOKE_PERIOD_US   10000
+// choke decisions after which the optimistic unchoke moves to another requester
+#define OPTIMISTIC_ROUNDS 3
+// default number of downloaded segments of a file appended to its checkpoint at once
+#define CHECKPOINT_BATCH  32
 
 #define DIE(assertion, call_description)                    \
     do {                                                    \
@@ -22,13 +71,13 @@
             exit(EXIT_FAILURE);                             \
         }                                                   \
     } while (0)
-// client sends to tracker and init the files with the components
+// client sends to tracker and init the files with the components (one packed message)
 #define TAG_INIT_FILES    20
 // the tracker responds and sends to client ACK as a sign that comunication between clients can start(and downloading)
 #define TAG_INIT_ACK      21    
 // client to tracker, when he wants a certain file
 #define TAG_WANT_FILE     22
-// tracker to client with information about the files (number of segments, seeds, hashes)
+// tracker to client with information about the files (name, number of segments, seeds, hashes), packed
 #define TAG_FILE_INFO     23
 // between clients when he has a segment request
 #define TAG_SEG_REQ       24
@@ -36,523 +85,3455 @@
 #define TAG_SEG_RSP       25
 // client informs tracker that he is seed now
 #define TAG_FILE_DONE     26
-// client to tracker, ready with downloading all of his files
+// client to its home tracker, ready with downloading all of his files; carries how many
+// TAG_FILE_DONE it sent to every tracker
 #define TAG_ALL_DONE      27
-// Sent by tracker to client when all finished
+// Sent by every tracker to every client when all finished
 #define TAG_FINISH        28   
+// client to tracker: the segments it has of a file and the last version it saw (packed),
+// the answer holds only the sources changed since
 #define TAG_WANT_UPDATE   29 
+// sent by a client to its own upload workers to stop them (one each), on segReqComm
+#define TAG_SHUTDOWN      30
+// client to tracker after TAG_FINISH, its Metrics (only built with -DTEMA2_METRICS)
+#define TAG_METRICS       31
+// tracker to the clients downloading a file: a new seed of it (SwarmPush)
+#define TAG_SWARM_PUSH    32
+// segment data on payloadComm, as it is traced (the real tag is the request slot)
+#define TAG_PAYLOAD       33
 
-// Contains its hashes
+// Tunables, read once from the environment in loadConfig
 typedef struct {
-    char hash[HASH_SIZE + 1];
-} Segment;
+    // segment requests in flight per downloader (TEMA2_WINDOW)
+    int requestWindow;
+    // longest sleep between polls of an idle wait (TEMA2_IDLE_MAX_US)
+    int idleMaxUs;
+    // threads serving segment requests (TEMA2_UPLOAD_WORKERS)
+    int uploadWorkers;
+    // 1: choose sources by their statistics, 0: cyclic round robin (TEMA2_WEIGHTED_SOURCES)
+    int weightedSources;
+    // 1: count the queue depth hints of the answers in the source choice (TEMA2_QUEUE_HINT)
+    int queueHint;
+    // 1: print timestamped events for bench/swarm_bench.py (TEMA2_BENCH)
+    int bench;
+    // bytes of data carried by every segment, 0 sends only the OK/NO answers (TEMA2_PAYLOAD)
+    int payload;
+    // 1: the tracker pushes new seeds to the downloaders of a file (TEMA2_SWARM_PUSH)
+    int swarmPush;
+    // tracker ranks, each one owns the files hashed to it (TEMA2_TRACKERS)
+    int trackers;
+    // sources (rank + bitfield) piggybacked on every segment answer, 0 turns PEX off (TEMA2_PEX)
+    int pex;
+    // segments downloaded between two TAG_WANT_UPDATE of a file, 0 never asks again (TEMA2_SWARM_UPDATE)
+    int swarmUpdate;
+    // missing segments of a file that start its endgame, 0 turns it off (TEMA2_ENDGAME)
+    int endgame;
+    // most segments asked with one TAG_SEG_REQ (TEMA2_BATCH)
+    int batch;
+    // requesters served at the same time, 0 serves everybody (TEMA2_UPLOAD_SLOTS)
+    int uploadSlots;
+    // time between two choke decisions (TEMA2_CHOKE_US)
+    int chokeUs;
+    // 1: segments are fetched with MPI_Get from the windows the clients expose (TEMA2_RMA)
+    int rma;
+    // segments appended to the checkpoint of a download at once, 0 keeps none (TEMA2_CHECKPOINT)
+    int checkpoint;
+} Config;
 
-// Name, number of segments and hashes for each of them
+static Config config = { REQUEST_WINDOW, IDLE_MAX_US, UPLOAD_WORKERS, 1, 1, 0, 0, 1, 1, PEX_ENTRIES, SWARM_UPDATE, ENDGAME_SEGMENTS, SEG_BATCH,
+                         UPLOAD_SLOTS, CHOKE_PERIOD_US, 0, CHECKPOINT_BATCH };
+
+// Every kind of traffic has its own copy of MPI_COMM_WORLD (same ranks), so a probe or a
+// receive only looks at the messages it can match.
+// the client <-> tracker messages, from TAG_INIT_FILES to TAG_METRICS
+static MPI_Comm swarmComm;
+// TAG_SEG_REQ and TAG_SHUTDOWN travel here, so the upload workers wait on one communicator
+static MPI_Comm segReqComm;
+// TAG_SEG_RSP, the answers of the upload workers
+static MPI_Comm segRspComm;
+// segment data of the payload mode, the tag is the request slot of the downloader
+static MPI_Comm payloadComm;
+// the tracker ranks, for the completion reduction; MPI_COMM_NULL on clients
+static MPI_Comm trackerComm;
+// the client ranks, in rank order, for the windows of the one-sided mode; MPI_COMM_NULL on trackers
+static MPI_Comm clientComm;
+
+// Name, number of segments, the digest of each of them and which ones we hold. The arrays
+// are sized to numSegments
 typedef struct {
     char filename[MAX_FILENAME + 1];
     int  numSegments;
-    Segment segments[MAX_CHUNKS];
+    // numSegments digests, 16 bytes aligned
+    unsigned char (*digests)[DIGEST_SIZE];
+    // the hashes were written with uppercase letters
+    int upper;
+    // bit s is set when segment s is held
+    uint64_t* present;
+    // payload mode: the mapped data of the file, NULL otherwise
+    char* store;
+    // while the file is downloaded: the Download with its sources, for the PEX of the answers
+    struct Download* download;
 } File;
 
-// FileConstructor: client's owned files and wanted ones
-typedef struct {
-    int numFilesHave;
-    File haveFiles[MAX_FILES];
-    int numFilesWant;
-    char wantFiles[MAX_FILES][MAX_FILENAME + 1];
-} FileConstructor;
+// FileConstructor: client's owned files and wanted ones. haveFiles has room for the
+// wanted files too, so the entries added while downloading never move
+typedef struct {
+    int numFilesHave;
+    File* haveFiles;
+    int numFilesWant;
+    char (*wantFiles)[MAX_FILENAME + 1];
+} FileConstructor;
+
+// Upload slots of a client: who is unchoked (served) and what is known about every
+// requester in the current choke period; the counters are indexed by rank
+typedef struct {
+    pthread_mutex_t lock;
+    // MPI_Wtime of the last choke decision
+    double periodStart;
+    int rounds;
+    // rank of the optimistic unchoke, -1 before the first one
+    int optimistic;
+    // size of unchoked, one per rank
+    size_t slots;
+    unsigned char* unchoked;
+    int unchokedCount;
+    // requests got from every rank (the interested ones asked at least once)
+    int* asked;
+    // segments every rank gave to our downloads, added by the download thread
+    int* gave;
+    // segments we gave to every rank
+    int* served;
+} Choker;
+
+// A file in the directory a client exposes in the one-sided mode
+typedef struct {
+    char filename[MAX_FILENAME + 1];
+    int numSegments;
+    // offset of its present bitset in the shared segment
+    MPI_Aint bits;
+    // address of its store in dataWin, 0 without payload
+    MPI_Aint store;
+} RmaEntry;
+
+// Start of the shared segment of a client, its bitsets follow the entries
+typedef struct {
+    MPI_Aint count;
+    RmaEntry entries[];
+} RmaDir;
+
+// One-sided mode: every client puts a directory of its files and their present bitsets in an
+// MPI-3 shared memory segment (read with plain loads by the clients on the same node), and
+// exposes that segment and its stores in a dynamic window for MPI_Get from everywhere
+typedef struct {
+    MPI_Comm nodeComm;
+    MPI_Win shmWin;
+    char* segment;
+    MPI_Aint segmentSize;
+    MPI_Win dataWin;
+    // per world rank: address of its segment in dataWin and its rank in nodeComm (-1 elsewhere)
+    MPI_Aint* segBase;
+    int* nodeRank;
+    // per world rank: its directory once looked at; in the shared segment on our node, a copy otherwise
+    RmaDir** dirs;
+} Rma;
+
+typedef struct {
+    int rank;
+    // size of MPI_COMM_WORLD, bounds any seeds list
+    int numtasks;
+    // upload slots, used when config.uploadSlots > 0
+    Choker choker;
+    // used when config.rma is set
+    Rma rma;
+    // haveFiles is written by the download thread and read by the upload workers
+    pthread_rwlock_t lock;
+    // taken over from the FileConstructor
+    int numFilesHave;
+    File* haveFiles;
+    int numFilesWant;
+    char (*wantFiles)[MAX_FILENAME + 1];
+    // per wanted file: the segments its checkpoint from an earlier run holds (numSegments 0
+    // without one), until the downloads start; NULL when config.checkpoint is 0
+    File* resumed;
+    // for download thread
+    int downloadFinished;
+    // final from tracker
+    int final;
+    // requests the upload workers are answering right now
+    int serving;
+    // TAG_SWARM_PUSH messages received, TAG_FINISH tells how many were sent
+    int pushes;
+    // TAG_FILE_DONE sent to every tracker, reported with TAG_ALL_DONE
+    int* doneSent;
+} Client;
+
+// A TAG_SEG_REQ, one message so concurrent receivers can't split it. It asks for count
+// consecutive segments starting with segment
+typedef struct {
+    char filename[MAX_FILENAME + 1];
+    int segment;
+    int count;
+    // downloader's own id of the file, echoed in the answer
+    int fileId;
+    // payload mode: tag of the payload message on payloadComm
+    int slot;
+} SegRequest;
+
+// A TAG_SWARM_PUSH: rank became the index-th seed of filename
+typedef struct {
+    char filename[MAX_FILENAME + 1];
+    int index;
+    int rank;
+} SwarmPush;
+
+// Answer to a TAG_SEG_REQ, echoes the file and segment so pipelined requests can be matched.
+// status is "OK" when every asked segment is given, granted has bit i set for segment + i.
+// pexCount entries follow it in the same message, each an int rank and the bitfield of
+// the segments that rank holds
+typedef struct {
+    uint64_t granted;
+    int fileId;
+    int segment;
+    // other requests the source was answering at the same time
+    int queueDepth;
+    // "BSY": we are choked for about retryUs more, ask someone else
+    int retryUs;
+    int pexCount;
+    char status[4];
+} SegResponse;
+
+// What a downloader learned about a source from its answers
+typedef struct {
+    // moving average of the answer time in seconds, 0 before the first answer
+    double latency;
+    // moving average of the "NO" answers
+    double noRate;
+    // requests sent to it and not answered yet
+    int outstanding;
+    // last queue depth hint it sent
+    int queueDepth;
+    // MPI_Wtime until which it said it is busy for us
+    double busyUntil;
+} SourceStats;
+
+// Checkpoint of a download, client<R>_<file>.part: the header, the digests from the tracker,
+// then one record for every segment received and verified, appended config.checkpoint at a time
+typedef struct {
+    char magic[4];
+    char filename[MAX_FILENAME + 1];
+    int numSegments;
+} CheckpointHeader;
+
+typedef struct {
+    int segment;
+    unsigned char digest[DIGEST_SIZE];
+} CheckpointRecord;
+
+// A message in the trace of a rank (-DTEMA2_TRACE): wall clock seconds, the other rank, the
+// tag and size; dir is 'S' or 'R' and role the thread, 'T'racker, 'D'ownload, 'U'pload or 'P'eer
+typedef struct {
+    double time;
+    int peer;
+    int tag;
+    int bytes;
+    char dir;
+    char role;
+} TraceRecord;
+
+// state of a segment of a Download
+#define SEG_MISSING       0
+#define SEG_ASKED         1
+#define SEG_DONE          2
+
+// A wanted file while it is downloaded. The sources (seeds and peers) change under the
+// client lock, the upload workers read them to gossip
+typedef struct Download {
+    // name, number of segments and digests from the tracker
+    File info;
+    // partial entry in haveFiles
+    int haveIndex;
+    // clients with the complete file
+    int* seeds;
+    int seedCount;
+    // clients with part of the file, peerHave holds a bitfield of each of them
+    int* peers;
+    unsigned char* peerHave;
+    int peerCount;
+    // per segment: how many sources hold it and its SEG_ state
+    int* avail;
+    unsigned char* state;
+    // segments in SEG_MISSING
+    int unasked;
+    // where the rarest-first scan starts, differs between clients to break ties
+    int scanStart;
+    // contor for downloaded segments
+    int received;
+    // no source holds the segments still missing, until the next swarm update
+    int blocked;
+    // per segment: the distinct sources that said "NO" for it, refusedBy[s] holds the
+    // refused[s] ranks (NULL before the first)
+    int* refused;
+    int** refusedBy;
+    // some segment was refused by every source holding it
+    int failed;
+    // MPI_Wtime until which every holder of its rarest segment said it is busy
+    double chokedUntil;
+    // payload mode: the mapped output, the same as the client's store of the partial entry
+    char* store;
+    // tracker version of the sources we know, seeds is a prefix of the tracker's list
+    int version;
+    // where the upload workers start picking the sources they gossip
+    int pexNext;
+    // checkpoint file (-1 without) and the records not written yet
+    int checkpointFd;
+    CheckpointRecord* checkpointBuf;
+    int checkpointPending;
+} Download;
+
+// One outstanding segment request of the download window
+typedef struct {
+    // index in the downloads list
+    int file;
+    // first requested segment, -1 when the slot is free, and how many follow it
+    int segment;
+    int count;
+    // who was asked
+    int srank;
+    // persistent send of msg, bound to sendTo (-1 before the first request of the slot)
+    SegRequest msg;
+    MPI_Request send;
+    int sendTo;
+    // payload mode: receive of the segments data, straight into the store or, for the endgame
+    // copies, into the scratch buffer of the slot; bytes is set when it completed
+    MPI_Request payload;
+    char* into;
+    int bytes;
+    // MPI_Wtime when it was sent
+    double sentAt;
+} PendingRequest;
+
+// Bump allocator for the tracker catalog, all the blocks are released together
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+// A client holding only part of a file, with the segments it announced
+typedef struct {
+    int rank;
+    unsigned char* have;
+    // file version of the last change of have
+    int version;
+} PartialPeer;
+
+// Files for tracker
+typedef struct {
+    // interned in the catalog arena
+    const char* filename;
+    unsigned int key;
+    int  numSegments;
+    // numSegments digests
+    unsigned char* digests;
+    // hex case of the hashes, from the first owner
+    int upper;
+    // Array of clients' ids that have completed files, in arrival order
+    int* seeds;
+    int seedCount;
+    int seedCapacity;
+    // the same clients as a bitset indexed by rank
+    uint64_t* seedSet;
+    // clients downloading the file, with their bitfields
+    PartialPeer* peers;
+    int peerCount;
+    int peerCapacity;
+    // index + 1 in peers for every rank, allocated with the first peer
+    int* peerSlot;
+    // bumped by every change of the sources, clients ask for what changed since theirs
+    int version;
+    // bitset of the ranks downloading the file, they get TAG_SWARM_PUSH for new seeds
+    uint64_t* subscribed;
+    // packed TAG_FILE_INFO answer, NULL when the sources changed since it was built
+    char* info;
+    int infoSize;
+} Tracker;
+
+// Every file known by the tracker, found by name with an open addressing table
+typedef struct {
+    Arena arena;
+    Tracker* files;
+    int count;
+    int capacity;
+    // indexes in files, -1 for a free slot; the size is a power of two
+    int* table;
+    int tableSize;
+    // uint64_t words of a seeds bitset
+    int setWords;
+    int numtasks;
+} Catalog;
+
+// Reader of an mmap'd input file; the lines are parsed where they are, without copies
+typedef struct {
+    const char* pos;
+    const char* end;
+} Cursor;
+
+// next line without its end of line (\n or \r\n), NULL at the end of the input
+static const char* nextLine(Cursor* cur, int* len)
+{
+    if (cur->pos >= cur->end) {
+        return NULL;
+    }
+    const char* line = cur->pos;
+    const char* nl = (const char*)memchr(line, '\n', cur->end - line);
+    const char* stop = nl ? nl : cur->end;
+    cur->pos = nl ? nl + 1 : cur->end;
+    if (stop > line && stop[-1] == '\r') {
+        stop--;
+    }
+    *len = (int)(stop - line);
+    return line;
+}
+
+static int isBlank(char ch)
+{
+    return ch == ' ' || ch == '\t';
+}
+
+// Decimal count at *p (blanks before it are skipped), -1 if there is none or it doesn't
+// fit an int
+static long parseCount(const char** p, const char* end)
+{
+    while (*p < end && isBlank(**p)) {
+        (*p)++;
+    }
+    if (*p == end || **p < '0' || **p > '9') {
+        return -1;
+    }
+    long v = 0;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        v = v * 10 + (**p - '0');
+        if (v > 0x7fffffff) {
+            return -1;
+        }
+    }
+    return v;
+}
+
+// only blanks left on the line
+static int restBlank(const char* p, const char* end)
+{
+    for (; p < end; p++) {
+        if (!isBlank(*p)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// FNV-1a of a filename
+static unsigned int nameHash(const char* name)
+{
+    unsigned int h = 2166136261u;
+    for (; *name; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+// Sharded trackers: ranks 0 .. config.trackers - 1 are trackers and each of them owns the
+// files whose name hashes to it. The clients are the ranks after them
+static int trackerOf(const char* filename)
+{
+    return (int)(nameHash(filename) % (unsigned)config.trackers);
+}
+
+// the tracker a client reports TAG_ALL_DONE to
+static int homeTracker(int rank)
+{
+    return rank % config.trackers;
+}
+
+static int hexValue(char ch)
+{
+    if (ch >= '0' && ch <= '9') {
+        return ch - '0';
+    }
+    if (ch >= 'a' && ch <= 'f') {
+        return ch - 'a' + 10;
+    }
+    if (ch >= 'A' && ch <= 'F') {
+        return ch - 'A' + 10;
+    }
+    return -1;
+}
+
+// HASH_SIZE hex digits (len characters of text) to a digest, -1 if the text is anything else;
+// otherwise HEX_LOWER and/or HEX_UPPER for the letters it had (0 for digits only)
+static int parseDigest(const char* hex, int len, unsigned char* digest)
+{
+    if (len < HASH_SIZE || !restBlank(hex + HASH_SIZE, hex + len)) {
+        return -1;
+    }
+    int letters = 0;
+    for (int i = 0; i < HASH_SIZE; i++) {
+        int v = hexValue(hex[i]);
+        if (v < 0) {
+            return -1;
+        }
+        if (v > 9) {
+            letters |= hex[i] >= 'a' ? HEX_LOWER : HEX_UPPER;
+        }
+        digest[i / 2] = i % 2 ? (unsigned char)(digest[i / 2] << 4 | v) : (unsigned char)v;
+    }
+    return letters;
+}
+
+static void formatDigest(const unsigned char* digest, char* hex, int upper)
+{
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    for (int i = 0; i < DIGEST_SIZE; i++) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 15];
+    }
+    hex[HASH_SIZE] = '\0';
+}
+
+static int isPresent(const File* f, int s)
+{
+    return (f->present[s / 64] >> (s % 64)) & 1;
+}
+
+// a release store: in the one-sided mode the bitset is read by the other processes of the
+// node (acquire loads in rmaFetch), who must see the segment data once they see its bit
+static void setPresent(File* f, int s)
+{
+    __atomic_fetch_or(&f->present[s / 64], (uint64_t)1 << (s % 64), __ATOMIC_RELEASE);
+}
+
+static int presentWords(int numSegments)
+{
+    return (numSegments + 63) / 64;
+}
+
+// Give f the digests and present bitset of numSegments segments (none present)
+static void allocSegments(File* f, int numSegments)
+{
+    f->numSegments = numSegments;
+    // a multiple of 16 bytes, as aligned_alloc wants
+    f->digests = (unsigned char (*)[DIGEST_SIZE])aligned_alloc(16, (size_t)(numSegments > 0 ? numSegments : 1) * DIGEST_SIZE);
+    f->present = (uint64_t*)calloc(presentWords(numSegments) > 0 ? presentWords(numSegments) : 1, sizeof(uint64_t));
+    DIE(f->digests == NULL || f->present == NULL, "malloc() failed!\n");
+}
+
+static void freeFiles(File* files, int count)
+{
+    for (int i = 0; i < count; i++) {
+        free(files[i].digests);
+        free(files[i].present);
+    }
+    free(files);
+}
+
+// segments held of f
+static int presentCount(const File* f)
+{
+    int count = 0;
+    for (int w = 0; w < presentWords(f->numSegments); w++) {
+        count += __builtin_popcountll(f->present[w]);
+    }
+    return count;
+}
+
+// Integer from the environment, def when missing or out of [lo, hi]
+static int envInt(const char *name, int def, int lo, int hi)
+{
+    const char *value = getenv(name);
+    if (!value || *value == '\0') {
+        return def;
+    }
+    char *end;
+    long v = strtol(value, &end, 10);
+    if (*end != '\0' || v < lo || v > hi) {
+        fprintf(stderr, "Ignoring %s=%s\n", name, value);
+        return def;
+    }
+    return (int)v;
+}
+
+static void loadConfig(void)
+{
+    config.requestWindow = envInt("TEMA2_WINDOW", REQUEST_WINDOW, 1, MAX_WINDOW);
+    config.idleMaxUs = envInt("TEMA2_IDLE_MAX_US", IDLE_MAX_US, 0, 1000000);
+    config.uploadWorkers = envInt("TEMA2_UPLOAD_WORKERS", UPLOAD_WORKERS, 1, MAX_WORKERS);
+    config.weightedSources = envInt("TEMA2_WEIGHTED_SOURCES", 1, 0, 1);
+    config.queueHint = envInt("TEMA2_QUEUE_HINT", 1, 0, 1);
+    config.bench = envInt("TEMA2_BENCH", 0, 0, 1);
+    config.payload = envInt("TEMA2_PAYLOAD", 0, 0, MAX_PAYLOAD);
+    config.swarmPush = envInt("TEMA2_SWARM_PUSH", 1, 0, 1);
+    config.trackers = envInt("TEMA2_TRACKERS", 1, 1, MAX_TRACKERS);
+    config.pex = envInt("TEMA2_PEX", PEX_ENTRIES, 0, MAX_PEX);
+    config.swarmUpdate = envInt("TEMA2_SWARM_UPDATE", SWARM_UPDATE, 0, 1 << 30);
+    config.endgame = envInt("TEMA2_ENDGAME", ENDGAME_SEGMENTS, 0, 1 << 30);
+    config.batch = envInt("TEMA2_BATCH", SEG_BATCH, 1, MAX_BATCH);
+    config.uploadSlots = envInt("TEMA2_UPLOAD_SLOTS", UPLOAD_SLOTS, 0, 1 << 20);
+    config.chokeUs = envInt("TEMA2_CHOKE_US", CHOKE_PERIOD_US, 1, 1 << 30);
+    config.rma = envInt("TEMA2_RMA", 0, 0, 1);
+    config.checkpoint = envInt("TEMA2_CHECKPOINT", CHECKPOINT_BATCH, 0, 1 << 20);
+}
+
+// Benchmark event on stdout: BENCH <event> <rank> <wall clock seconds> <file or ->.
+// The ranks of a run share the machine clock, so the harness can compare them
+static void benchEvent(const char *event, int rank, const char *file)
+{
+    if (!config.bench) {
+        return;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    printf("BENCH %s %d %.6f %s\n", event, rank, ts.tv_sec + ts.tv_nsec / 1e9, file ? file : "-");
+    fflush(stdout);
+}
+
+#ifdef TEMA2_METRICS
+// Instrumentation, compiled in with -DTEMA2_METRICS. Without it the METRIC() statements
+// disappear and nothing is measured. Every client sends its Metrics to the tracker after
+// TAG_FINISH and the tracker writes them, summed up, to TEMA2_METRICS_FILE (metrics.json)
+#define METRIC(stmt)      stmt
+// latency histograms have power of two buckets of microseconds: [0, 1), [1, 2), [2, 4) ...
+#define HIST_BUCKETS      32
+#define NUM_TAGS          (TAG_METRICS - TAG_INIT_FILES + 1)
+
+typedef struct {
+    long count;
+    double sumUs;
+    long buckets[HIST_BUCKETS];
+} Histogram;
+
+typedef struct {
+    // download side
+    long segRequests;
+    long segOk;
+    long segNo;
+    long swarmUpdates;
+    // endgame copies sent, and answers that came after another copy won
+    long segDuplicates;
+    long segWasted;
+    // "BSY" answers got
+    long segBusy;
+    Histogram rtt;
+    // upload side
+    long served;
+    // requests answered "BSY" because the requester was choked
+    long busySent;
+    Histogram service;
+    // tracker side, indexed by tag - TAG_INIT_FILES
+    long tagCount[NUM_TAGS];
+    Histogram tagTime[NUM_TAGS];
+} Metrics;
+
+static Metrics metrics;
+// the upload workers share metrics.served and metrics.service
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void histAdd(Histogram* h, double seconds)
+{
+    double us = seconds * 1e6;
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && us >= (double)(1L << b)) {
+        b++;
+    }
+    h->count++;
+    h->sumUs += us;
+    h->buckets[b]++;
+}
+
+static void histMerge(Histogram* into, const Histogram* h)
+{
+    into->count += h->count;
+    into->sumUs += h->sumUs;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        into->buckets[b] += h->buckets[b];
+    }
+}
+
+static void metricsMerge(Metrics* into, const Metrics* m)
+{
+    into->segRequests += m->segRequests;
+    into->segOk += m->segOk;
+    into->segNo += m->segNo;
+    into->swarmUpdates += m->swarmUpdates;
+    into->segDuplicates += m->segDuplicates;
+    into->segWasted += m->segWasted;
+    into->segBusy += m->segBusy;
+    into->busySent += m->busySent;
+    histMerge(&into->rtt, &m->rtt);
+    into->served += m->served;
+    histMerge(&into->service, &m->service);
+    for (int t = 0; t < NUM_TAGS; t++) {
+        into->tagCount[t] += m->tagCount[t];
+        histMerge(&into->tagTime[t], &m->tagTime[t]);
+    }
+}
+
+// upper bound (microseconds) of the bucket holding the q quantile
+static long histQuantile(const Histogram* h, double q)
+{
+    long seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (h->count > 0 && seen >= q * h->count) {
+            return 1L << b;
+        }
+    }
+    return 0;
+}
+
+static void histJson(FILE* f, const Histogram* h)
+{
+    fprintf(f, "{\"count\": %ld, \"mean_us\": %.3f, \"p50_us\": %ld, \"p99_us\": %ld, \"buckets\": [",
+            h->count, h->count ? h->sumUs / h->count : 0.0, histQuantile(h, 0.5), histQuantile(h, 0.99));
+    // trailing empty buckets are left out, bucket b counts samples below 2^b us
+    int last = HIST_BUCKETS - 1;
+    while (last > 0 && h->buckets[last] == 0) {
+        last--;
+    }
+    for (int b = 0; b <= last; b++) {
+        fprintf(f, "%s%ld", b ? ", " : "", h->buckets[b]);
+    }
+    fprintf(f, "]}");
+}
+
+static void clientJson(FILE* f, const Metrics* m)
+{
+    fprintf(f, "\"seg_requests\": %ld, \"seg_ok\": %ld, \"seg_no\": %ld, \"swarm_updates\": %ld, \"served\": %ld,\n",
+            m->segRequests, m->segOk, m->segNo, m->swarmUpdates, m->served);
+    fprintf(f, "      \"seg_duplicates\": %ld, \"seg_wasted\": %ld, \"seg_busy\": %ld, \"busy_sent\": %ld,\n",
+            m->segDuplicates, m->segWasted, m->segBusy, m->busySent);
+    fprintf(f, "      \"rtt\": ");
+    histJson(f, &m->rtt);
+    fprintf(f, ",\n      \"service\": ");
+    histJson(f, &m->service);
+}
+
+// Tracker: collect the metrics of every client and write the report
+static void writeMetricsReport(int numtasks)
+{
+    static const char* tagNames[NUM_TAGS] = {
+        "TAG_INIT_FILES", "TAG_INIT_ACK", "TAG_WANT_FILE", "TAG_FILE_INFO", "TAG_SEG_REQ", "TAG_SEG_RSP",
+        "TAG_FILE_DONE", "TAG_ALL_DONE", "TAG_FINISH", "TAG_WANT_UPDATE", "TAG_SHUTDOWN", "TAG_METRICS"
+    };
+    Metrics* all = (Metrics*)calloc(numtasks, sizeof(Metrics));
+    DIE(all == NULL, "calloc() failed!\n");
+    Metrics total;
+    memset(&total, 0, sizeof(total));
+    // the other trackers send on trackerComm, where their rank is the same, so rank 0 can't
+    // mistake it for a client message while it still waits for the last TAG_FILE_DONE
+    for (int c = 1; c < numtasks; c++) {
+        MPI_Comm comm = c < config.trackers ? trackerComm : swarmComm;
+        MPI_Recv(&all[c], sizeof(Metrics), MPI_BYTE, c, TAG_METRICS, comm, MPI_STATUS_IGNORE);
+        metricsMerge(&total, &all[c]);
+    }
+    metricsMerge(&total, &metrics);
+    const char* name = getenv("TEMA2_METRICS_FILE");
+    FILE* f = fopen(name && *name ? name : "metrics.json", "w");
+    if (!f) {
+        fprintf(stderr, "Can't write the metrics report\n");
+        free(all);
+        return;
+    }
+    fprintf(f, "{\n  \"ranks\": %d,\n  \"clients\": {\n      ", numtasks);
+    clientJson(f, &total);
+    fprintf(f, "\n  },\n  \"per_rank\": [\n");
+    for (int c = 1; c < numtasks; c++) {
+        fprintf(f, "    {\"rank\": %d, ", c);
+        clientJson(f, &all[c]);
+        fprintf(f, "}%s\n", c + 1 < numtasks ? "," : "");
+    }
+    fprintf(f, "  ],\n  \"tracker\": {\n");
+    int first = 1;
+    for (int t = 0; t < NUM_TAGS; t++) {
+        if (total.tagCount[t] == 0) {
+            continue;
+        }
+        fprintf(f, "%s    \"%s\": {\"count\": %ld, \"time\": ", first ? "" : ",\n", tagNames[t], total.tagCount[t]);
+        histJson(f, &total.tagTime[t]);
+        fprintf(f, "}");
+        first = 0;
+    }
+    fprintf(f, "\n  }\n}\n");
+    fclose(f);
+    free(all);
+}
+#else
+#define METRIC(stmt)
+#endif
+
+#ifdef TEMA2_TRACE
+// Message trace, compiled in with -DTEMA2_TRACE. Every send and receive of the tracker, the
+// download thread, the upload workers and peer() is a TraceRecord in trace<R>.bin (in
+// TEMA2_TRACE_DIR, the current directory by default), buffered and written TRACE_BUFFER at
+// a time. Payload messages are traced with TAG_PAYLOAD, their real tag is the request slot.
+// bench/swarm_sim.c --trace DIR sums the files up
+#define TRACE(dir, peer, tag, bytes) traceEvent(dir, peer, tag, bytes)
+#define TRACE_ROLE(role)  traceRole = role
+#define TRACE_BUFFER      4096
+
+static TraceRecord traceBuf[TRACE_BUFFER];
+static int traceCount;
+static FILE* traceFile;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+// TRACE_ROLE of the calling thread
+static __thread char traceRole = 'P';
+
+static void traceFlush(void)
+{
+    if (traceFile && traceCount > 0) {
+        fwrite(traceBuf, sizeof(TraceRecord), traceCount, traceFile);
+    }
+    traceCount = 0;
+}
+
+static void traceOpen(int rank)
+{
+    const char* dir = getenv("TEMA2_TRACE_DIR");
+    char name[256];
+    snprintf(name, sizeof(name), "%s/trace%d.bin", dir && *dir ? dir : ".", rank);
+    traceFile = fopen(name, "wb");
+    if (!traceFile) {
+        fprintf(stderr, "Can't write %s\n", name);
+    }
+}
+
+static void traceEvent(char dir, int peer, int tag, int bytes)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    pthread_mutex_lock(&traceLock);
+    TraceRecord* rec = &traceBuf[traceCount++];
+    rec->time = ts.tv_sec + ts.tv_nsec / 1e9;
+    rec->peer = peer;
+    rec->tag = tag;
+    rec->bytes = bytes;
+    rec->dir = dir;
+    rec->role = traceRole;
+    if (traceCount == TRACE_BUFFER) {
+        traceFlush();
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+static void traceClose(void)
+{
+    traceFlush();
+    if (traceFile) {
+        fclose(traceFile);
+    }
+}
+#else
+#define TRACE(dir, peer, tag, bytes)
+#define TRACE_ROLE(role)
+#endif
+
+// Parse in<R>.txt in one pass over the mapped file. The segments of every file are
+// allocated for their real number, read from its header line
+static FileConstructor* parseFile(const char *file_name)
+{
+    int fd = open(file_name, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr,"Cannot open %s\n", file_name);
+        return NULL;
+    }
+    struct stat sb;
+    DIE(fstat(fd, &sb) < 0, "fstat() failed!\n");
+    if (sb.st_size == 0) {
+        fprintf(stderr,"Error reading number of files!\n");
+        close(fd);
+        return NULL;
+    }
+    char* data = (char*)mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    DIE(data == MAP_FAILED, "mmap() failed!\n");
+    close(fd);
+    madvise(data, sb.st_size, MADV_SEQUENTIAL);
+    Cursor cur = { data, data + sb.st_size };
+
+    FileConstructor* file_constructor = (FileConstructor*)calloc(1, sizeof(FileConstructor));
+    DIE(file_constructor == NULL,"calloc() failed!\n");
+    const char* line;
+    const char* p;
+    int len;
+    // number of files that the client have; every one takes a line at least
+    line = nextLine(&cur, &len);
+    p = line;
+    long numHave = line ? parseCount(&p, line + len) : -1;
+    if (numHave < 0 || !restBlank(p, line + len) || numHave > cur.end - cur.pos) {
+        fprintf(stderr,"Error reading number of files!\n");
+        goto fail;
+    }
+    file_constructor->haveFiles = (File*)calloc(numHave > 0 ? numHave : 1, sizeof(File));
+    DIE(file_constructor->haveFiles == NULL, "calloc() failed!\n");
+
+    for (int i = 0 ; i < numHave; i++) {
+        line = nextLine(&cur, &len);
+        if (!line) {
+            fprintf(stderr,"Error! \n");
+            goto fail;
+        }
+        // "<name> <number of segments>"
+        const char* end = line + len;
+        p = line;
+        while (p < end && isBlank(*p)) {
+            p++;
+        }
+        const char* name = p;
+        while (p < end && !isBlank(*p)) {
+            p++;
+        }
+        int nameLen = (int)(p - name);
+        long segments_count = parseCount(&p, end);
+        if (nameLen == 0 || segments_count < 0 || !restBlank(p, end)) {
+            fprintf(stderr,"Format error! \n");
+            goto fail;
+        }
+        if (nameLen > MAX_FILENAME) {
+            fprintf(stderr,"File name %.*s longer than %d characters\n", nameLen, name, MAX_FILENAME);
+            goto fail;
+        }
+        // a hash line has HASH_SIZE characters at least
+        if (segments_count > (cur.end - cur.pos) / HASH_SIZE + 1) {
+            fprintf(stderr,"Error reading segment! \n");
+            goto fail;
+        }
+
+        File* f = &file_constructor->haveFiles[i];
+        memcpy(f->filename, name, nameLen);
+        allocSegments(f, (int)segments_count);
+        file_constructor->numFilesHave = i + 1;
+
+        int cases = 0;
+        for(int s = 0; s < segments_count; s++) {
+            line = nextLine(&cur, &len);
+            if (!line) {
+                fprintf(stderr,"Error reading segment! \n");
+                goto fail;
+            }
+            int letters = parseDigest(line, len, f->digests[s]);
+            if (letters < 0) {
+                fprintf(stderr,"Bad hash %.*s, expected %d hex digits\n", len, line, HASH_SIZE);
+                goto fail;
+            }
+            cases |= letters;
+            setPresent(f, s);
+        }
+        // the output copies the hashes as they were written, one case per file
+        if (cases == (HEX_LOWER | HEX_UPPER)) {
+            fprintf(stderr,"Hashes of %s mix lowercase and uppercase letters\n", f->filename);
+            goto fail;
+        }
+        f->upper = cases == HEX_UPPER;
+    }
+
+    // number wanted files
+    line = nextLine(&cur, &len);
+    p = line;
+    long numWant = line ? parseCount(&p, line + len) : -1;
+    if (numWant < 0 || !restBlank(p, line + len) || numWant > cur.end - cur.pos) {
+        fprintf(stderr,"Error! \n");
+        goto fail;
+    }
+    file_constructor->numFilesWant = (int)numWant;
+    file_constructor->wantFiles = (char (*)[MAX_FILENAME + 1])calloc(numWant > 0 ? numWant : 1, MAX_FILENAME + 1);
+    // room for the partial entries of the downloads
+    File* files = (File*)realloc(file_constructor->haveFiles, (numHave + numWant > 0 ? numHave + numWant : 1) * sizeof(File));
+    DIE(file_constructor->wantFiles == NULL || files == NULL, "calloc() failed!\n");
+    file_constructor->haveFiles = files;
+
+    // wanted files
+    for (int i = 0; i < numWant; i++) {
+        line = nextLine(&cur, &len);
+        if (!line) {
+            fprintf(stderr,"Error reading wanted files!\n");
+            goto fail;
+        }
+        while (len > 0 && isBlank(line[len - 1])) {
+            len--;
+        }
+        if (len > MAX_FILENAME) {
+            fprintf(stderr,"File name %.*s longer than %d characters\n", len, line, MAX_FILENAME);
+            goto fail;
+        }
+        memcpy(file_constructor->wantFiles[i], line, len);
+    }
+
+    munmap(data, sb.st_size);
+    return file_constructor;
+
+fail:
+    munmap(data, sb.st_size);
+    freeFiles(file_constructor->haveFiles, file_constructor->numFilesHave);
+    free(file_constructor->wantFiles);
+    free(file_constructor);
+    return NULL;
+}
+// client<R>_<file>.part
+static void checkpointName(int rank, const char* filename, char* name, int size)
+{
+    snprintf(name, size, "client%d_%s.part", rank, filename);
+}
+
+// The segments the checkpoint of filename from an earlier run holds, in f (with the digests
+// it was made with); 0 when there is none or it is not readable. A torn last record is
+// cut off the file, a record that doesn't match the digests is ignored
+static int loadCheckpoint(int rank, const char* filename, File* f)
+{
+    char name[64];
+    checkpointName(rank, filename, name, sizeof(name));
+    FILE* in = fopen(name, "rb");
+    if (!in) {
+        return 0;
+    }
+    // a torn or foreign header: the name must be terminated and the digests it announces
+    // must all be in the file
+    CheckpointHeader header;
+    struct stat sb;
+    if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, "T2CK", 4) != 0
+        || header.filename[MAX_FILENAME] != '\0' || strcmp(header.filename, filename) != 0 || header.numSegments <= 0
+        || fstat(fileno(in), &sb) < 0 || (sb.st_size - (off_t)sizeof(header)) / DIGEST_SIZE < header.numSegments) {
+        fclose(in);
+        return 0;
+    }
+    allocSegments(f, header.numSegments);
+    memcpy(f->filename, header.filename, MAX_FILENAME + 1);
+    if (fread(f->digests, DIGEST_SIZE, header.numSegments, in) != (size_t)header.numSegments) {
+        fclose(in);
+        return 0;
+    }
+    CheckpointRecord rec;
+    off_t records = 0;
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        records++;
+        if (rec.segment >= 0 && rec.segment < f->numSegments && memcmp(rec.digest, f->digests[rec.segment], DIGEST_SIZE) == 0) {
+            setPresent(f, rec.segment);
+        }
+    }
+    fclose(in);
+    // cut the torn record off, the records of this run are appended right after the whole ones
+    off_t whole = (off_t)sizeof(header) + (off_t)header.numSegments * DIGEST_SIZE + records * (off_t)sizeof(rec);
+    if (sb.st_size > whole && truncate(name, whole) < 0) {
+        fprintf(stderr, "Can't truncate %s\n", name);
+        return 0;
+    }
+    return 1;
+}
+
+// For initialization, at first the client reads the input file and take information from it
+static Client* initClient(int rank)
+{
+    char file_name[MAX_FILENAME];
+    snprintf(file_name, sizeof(file_name), "in%d.txt", rank);
+
+    FileConstructor* fc = parseFile(file_name);
+    if (!fc) {
+        return NULL;
+    }
+
+    Client* c = (Client*)calloc(1, sizeof(Client));
+    DIE(c == NULL,"calloc() failed!\n");
+    
+    c->rank = rank;
+    // the arrays move to the client, nothing is copied
+    c->numFilesHave = fc->numFilesHave;
+    c->haveFiles = fc->haveFiles;
+    c->numFilesWant= fc->numFilesWant;
+    c->wantFiles = fc->wantFiles;
+    // what an earlier run left of the wanted files
+    if (config.checkpoint > 0) {
+        c->resumed = (File*)calloc(c->numFilesWant > 0 ? c->numFilesWant : 1, sizeof(File));
+        DIE(c->resumed == NULL, "calloc() failed!\n");
+        for (int f = 0; f < c->numFilesWant; f++) {
+            if (!loadCheckpoint(rank, c->wantFiles[f], &c->resumed[f])) {
+                c->resumed[f].numSegments = 0;
+            }
+        }
+    }
+    c->downloadFinished = 0;
+    c->final = 0;
+    pthread_rwlock_init(&c->lock, NULL);
+
+    free(fc);
+    return c;
+}
+
+// Save the file in this format clientR_<filename>
+static void saveFile(Client* c, int file_index)
+{
+    char out_name[64];
+    snprintf(out_name, sizeof(out_name), "client%d_%s", c->rank, c->haveFiles[file_index].filename);
+
+    FILE* file = fopen(out_name,"w");
+    if (!file) {
+        fprintf(stderr,"Can't open %s\n", out_name);
+        return;
+    }
+    // save the ordered list of hashes
+    char hex[HASH_SIZE + 1];
+    for (int s = 0; s < c->haveFiles[file_index].numSegments; s++) {
+        formatDigest(c->haveFiles[file_index].digests[s], hex, c->haveFiles[file_index].upper);
+        fprintf(file,"%s\n", hex);
+    }
+    fclose(file);
+}
+
+// Payload mode. The data of a file lives in client<R>_<file>.payload, mapped in memory:
+// seeds send the segments straight from the mapping and downloaders receive them at their
+// offset. The input hashes don't come from any real data, so a segment is defined as its
+// digest repeated over config.payload bytes and that is what a received segment is checked for.
+// keep leaves the data already there, for a resumed download
+static char* openStore(int rank, const char* filename, int numSegments, int keep)
+{
+    size_t size = (size_t)numSegments * config.payload;
+    if (size == 0) {
+        return NULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "client%d_%s.payload", rank, filename);
+    int fd = open(name, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+    DIE(fd < 0, "open() failed!\n");
+    DIE(ftruncate(fd, (off_t)size) < 0, "ftruncate() failed!\n");
+    char* store = (char*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    DIE(store == MAP_FAILED, "mmap() failed!\n");
+    close(fd);
+    return store;
+}
+
+// write the data of an owned segment
+static void fillSegment(char* data, const unsigned char* digest)
+{
+    int done = config.payload < DIGEST_SIZE ? config.payload : DIGEST_SIZE;
+    memcpy(data, digest, done);
+    // copy what is already written, doubling every time
+    while (done < config.payload) {
+        int n = config.payload - done < done ? config.payload - done : done;
+        memcpy(data + done, data, n);
+        done += n;
+    }
+}
+
+// A digest is one 16 byte vector: the data is compared 64 bytes per round and a mismatch
+// is only looked for once per round
+static int checkSegment(const char* data, int size, const unsigned char* digest)
+{
+    if (size != config.payload) {
+        return 0;
+    }
+    int off = 0;
+#ifdef __SSE2__
+    __m128i d = _mm_load_si128((const __m128i*)digest);
+    for (; off + 4 * DIGEST_SIZE <= size; off += 4 * DIGEST_SIZE) {
+        const __m128i* p = (const __m128i*)(data + off);
+        __m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p), d), _mm_cmpeq_epi8(_mm_loadu_si128(p + 1), d)),
+                                   _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128(p + 2), d), _mm_cmpeq_epi8(_mm_loadu_si128(p + 3), d)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF) {
+            return 0;
+        }
+    }
+#endif
+    for (; off + DIGEST_SIZE <= size; off += DIGEST_SIZE) {
+        if (memcmp(data + off, digest, DIGEST_SIZE) != 0) {
+            return 0;
+        }
+    }
+    return memcmp(data + off, digest, size - off) == 0;
+}
+
+// map and fill the stores of the files owned from the start
+static void openStores(Client* c)
+{
+    for (int i = 0; i < c->numFilesHave; i++) {
+        File* f = &c->haveFiles[i];
+        f->store = openStore(c->rank, f->filename, f->numSegments, 0);
+        for (int s = 0; f->store && s < f->numSegments; s++) {
+            fillSegment(f->store + (size_t)s * config.payload, f->digests[s]);
+        }
+    }
+}
+
+static void closeStores(Client* c)
+{
+    for (int i = 0; i < c->numFilesHave; i++) {
+        if (c->haveFiles[i].store) {
+            munmap(c->haveFiles[i].store, (size_t)c->haveFiles[i].numSegments * config.payload);
+            c->haveFiles[i].store = NULL;
+        }
+    }
+}
+
+// Start the checkpoint of d: a resumed one gets its new records appended, otherwise it is
+// written from the header
+static void openCheckpoint(Client* c, Download* d, int resumed)
+{
+    d->checkpointFd = -1;
+    if (config.checkpoint == 0) {
+        return;
+    }
+    char name[64];
+    checkpointName(c->rank, d->info.filename, name, sizeof(name));
+    d->checkpointFd = open(name, O_WRONLY | O_CREAT | (resumed ? O_APPEND : O_TRUNC), 0644);
+    DIE(d->checkpointFd < 0, "open() failed!\n");
+    d->checkpointBuf = (CheckpointRecord*)malloc(config.checkpoint * sizeof(CheckpointRecord));
+    DIE(d->checkpointBuf == NULL, "malloc() failed!\n");
+    d->checkpointPending = 0;
+    if (resumed) {
+        return;
+    }
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "T2CK", 4);
+    strcpy(header.filename, d->info.filename);
+    header.numSegments = d->info.numSegments;
+    size_t size = (size_t)d->info.numSegments * DIGEST_SIZE;
+    if (write(d->checkpointFd, &header, sizeof(header)) != sizeof(header)
+        || write(d->checkpointFd, d->info.digests, size) != (ssize_t)size) {
+        fprintf(stderr, "Can't write %s\n", name);
+        close(d->checkpointFd);
+        d->checkpointFd = -1;
+    }
+}
+
+// append the records kept so far with one write; no fsync, a crash only loses the tail
+static void flushCheckpoint(Download* d)
+{
+    if (d->checkpointFd < 0 || d->checkpointPending == 0) {
+        return;
+    }
+    size_t size = d->checkpointPending * sizeof(CheckpointRecord);
+    if (write(d->checkpointFd, d->checkpointBuf, size) != (ssize_t)size) {
+        fprintf(stderr, "Can't write the checkpoint of %s\n", d->info.filename);
+        close(d->checkpointFd);
+        d->checkpointFd = -1;
+    }
+    d->checkpointPending = 0;
+}
+
+// segment s of d was received and verified
+static void checkpointSegment(Download* d, int s)
+{
+    if (d->checkpointFd < 0) {
+        return;
+    }
+    CheckpointRecord* rec = &d->checkpointBuf[d->checkpointPending++];
+    rec->segment = s;
+    memcpy(rec->digest, d->info.digests[s], DIGEST_SIZE);
+    if (d->checkpointPending == config.checkpoint) {
+        flushCheckpoint(d);
+    }
+}
+
+// the checkpoint of a complete file is not needed anymore, the one of a failed download stays
+static void closeCheckpoint(Client* c, Download* d, int complete)
+{
+    if (d->checkpointFd >= 0) {
+        if (!complete) {
+            flushCheckpoint(d);
+        }
+        close(d->checkpointFd);
+        d->checkpointFd = -1;
+    }
+    if (complete && config.checkpoint > 0) {
+        char name[64];
+        checkpointName(c->rank, d->info.filename, name, sizeof(name));
+        unlink(name);
+    }
+    free(d->checkpointBuf);
+    d->checkpointBuf = NULL;
+}
+
+// The checkpoint of an earlier run for d, when it was made with the digests the tracker has now
+static File* findResumed(Client* c, Download* d)
+{
+    for (int f = 0; c->resumed && f < c->numFilesWant; f++) {
+        File* old = &c->resumed[f];
+        if (old->numSegments == d->info.numSegments && strcmp(old->filename, d->info.filename) == 0
+            && memcmp(old->digests, d->info.digests, (size_t)old->numSegments * DIGEST_SIZE) == 0) {
+            return old;
+        }
+    }
+    return NULL;
+}
+
+// Take over the segments of a checkpoint before d starts; in payload mode only those whose
+// data in the store still matches
+static void resumeDownload(Download* d, File* old)
+{
+    for (int s = 0; s < d->info.numSegments; s++) {
+        if (!isPresent(old, s)) {
+            continue;
+        }
+        if (d->store && !checkSegment(d->store + (size_t)s * config.payload, config.payload, d->info.digests[s])) {
+            continue;
+        }
+        setPresent(&d->info, s);
+        d->state[s] = SEG_DONE;
+        d->received++;
+        d->unasked--;
+    }
+}
+
+// Packed messages. The digests of a file are contiguous and go on the wire as bytes
+static int packedSize(int count, MPI_Datatype type)
+{
+    int size;
+    MPI_Pack_size(count, type, MPI_COMM_WORLD, &size);
+    return size;
+}
+
+// Packed size of the digests and their hex case
+static int digestsSize(int numSegments)
+{
+    return packedSize(1, MPI_INT) + packedSize(numSegments * DIGEST_SIZE, MPI_BYTE);
+}
+
+// Packed size of a manifest: name, numSegments, digests
+static int manifestSize(int numSegments)
+{
+    return packedSize(MAX_FILENAME + 1, MPI_CHAR) + packedSize(1, MPI_INT) + digestsSize(numSegments);
+}
+
+static void packDigests(const unsigned char* digests, int numSegments, int upper, char* buf, int size, int* pos)
+{
+    if (numSegments <= 0) {
+        return;
+    }
+    MPI_Pack(&upper, 1, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+    MPI_Pack(digests, numSegments * DIGEST_SIZE, MPI_BYTE, buf, size, pos, MPI_COMM_WORLD);
+}
+
+static void unpackDigests(char* buf, int size, int* pos, unsigned char* digests, int numSegments, int* upper)
+{
+    if (numSegments <= 0) {
+        return;
+    }
+    MPI_Unpack(buf, size, pos, upper, 1, MPI_INT, MPI_COMM_WORLD);
+    MPI_Unpack(buf, size, pos, digests, numSegments * DIGEST_SIZE, MPI_BYTE, MPI_COMM_WORLD);
+}
+
+// Segment bitfields, bit i of byte i / 8 is segment i
+static int bitfieldBytes(int numSegments)
+{
+    return (numSegments + 7) / 8;
+}
+
+static int bitGet(const unsigned char* bits, int i)
+{
+    return (bits[i / 8] >> (i % 8)) & 1;
+}
+
+static void bitSet(unsigned char* bits, int i)
+{
+    bits[i / 8] |= (unsigned char)(1 << (i % 8));
+}
+
+// Wait for a packed message of unknown size, the caller frees it
+static char* recvPacked(int src, int tag, int* size, MPI_Status* st)
+{
+    MPI_Probe(src, tag, swarmComm, st);
+    MPI_Get_count(st, MPI_PACKED, size);
+    char* buf = (char*)malloc(*size > 0 ? *size : 1);
+    DIE(buf == NULL, "malloc() failed!\n");
+    MPI_Recv(buf, *size, MPI_PACKED, st->MPI_SOURCE, tag, swarmComm, st);
+    TRACE('R', st->MPI_SOURCE, tag, *size);
+    return buf;
+}
+
+// Wait for a message like MPI_Mprobe without keeping a core busy: after IDLE_SPIN polls
+// it sleeps between them, doubling the pause up to config.idleMaxUs. The matched message
+// can only be received through msg, so threads waiting on the same source and tag can't
+// steal it from each other
+static void idleMprobe(int src, int tag, MPI_Comm comm, MPI_Message* msg, MPI_Status* st)
+{
+    if (config.idleMaxUs == 0) {
+        MPI_Mprobe(src, tag, comm, msg, st);
+        return;
+    }
+    long pauseUs = 1;
+    for (int polls = 0; ; polls++) {
+        int flag = 0;
+        MPI_Improbe(src, tag, comm, &flag, msg, st);
+        if (flag) {
+            return;
+        }
+        if (polls < IDLE_SPIN) {
+            continue;
+        }
+        struct timespec ts = { pauseUs / 1000000, (pauseUs % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+        if (pauseUs < config.idleMaxUs) {
+            pauseUs = 2 * pauseUs < config.idleMaxUs ? 2 * pauseUs : config.idleMaxUs;
+        }
+    }
+}
+
+// add a (rank, bitfield) PEX entry at *pos of buf
+static void pexEntry(char* buf, int* pos, int rank, const unsigned char* have, int bytes)
+{
+    memcpy(buf + *pos, &rank, sizeof(int));
+    if (have == (const unsigned char*)(buf + *pos + sizeof(int))) {
+        // built in place already (our own entry)
+    } else if (have) {
+        memcpy(buf + *pos + sizeof(int), have, bytes);
+    } else {
+        // a seed holds everything, the bits past the last segment are never read
+        memset(buf + *pos + sizeof(int), 0xff, bytes);
+    }
+    *pos += sizeof(int) + bytes;
+}
+
+// Peer exchange: up to config.pex sources of f written after the answer in buf, called with
+// the client lock held. First ourselves with the segments we hold (not for a file we had
+// from the start, the tracker announced us as its seed), then the seeds and peers our own
+// download of f knows about, from a different one every time and without the requester
+static int packPex(Client* c, File* f, int requester, char* buf, int* pos)
+{
+    int bytes = bitfieldBytes(f->numSegments);
+    int count = 0;
+    Download* d = f->download;
+    if (d != NULL && config.pex > 0) {
+        unsigned char* have = (unsigned char*)(buf + *pos + sizeof(int));
+        memset(have, 0, bytes);
+        for (int s = 0; s < f->numSegments; s++) {
+            if (isPresent(f, s)) {
+                bitSet(have, s);
+            }
+        }
+        pexEntry(buf, pos, c->rank, have, bytes);
+        count++;
+    }
+    if (d == NULL) {
+        return count;
+    }
+    int known = d->seedCount + d->peerCount;
+    int start = known > 0 ? __atomic_fetch_add(&d->pexNext, 1, __ATOMIC_RELAXED) % known : 0;
+    for (int i = 0; i < known && count < config.pex; i++) {
+        int k = (start + i) % known;
+        int rank = k < d->seedCount ? d->seeds[k] : d->peers[k - d->seedCount];
+        if (rank == requester) {
+            continue;
+        }
+        pexEntry(buf, pos, rank, k < d->seedCount ? NULL : d->peerHave + (size_t)(k - d->seedCount) * bytes, bytes);
+        count++;
+    }
+    return count;
+}
+
+// bits 0 .. count - 1
+static uint64_t batchMask(int count)
+{
+    return count >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << count) - 1;
+}
+
+// Payload mode: the data of count segments from base, each at its place in the message. A
+// segment not granted is sent as zeros (the downloader drops it by the bitmap), so a partial
+// answer goes out as an hindexed type over the store and the zeros; nothing granted sends
+// an empty message
+static void sendSegments(const char* store, int base, int count, uint64_t granted, const char* zeros, int dst, int tag)
+{
+    size_t size = config.payload;
+    if (granted == 0) {
+        MPI_Send(NULL, 0, MPI_BYTE, dst, tag, payloadComm);
+        TRACE('S', dst, TAG_PAYLOAD, 0);
+    } else if (granted == batchMask(count)) {
+        MPI_Send(store + base * size, count * config.payload, MPI_BYTE, dst, tag, payloadComm);
+        TRACE('S', dst, TAG_PAYLOAD, count * config.payload);
+    } else {
+        int lengths[MAX_BATCH];
+        MPI_Aint displs[MAX_BATCH];
+        for (int i = 0; i < count; i++) {
+            lengths[i] = config.payload;
+            MPI_Get_address((granted >> i) & 1 ? store + (base + i) * size : zeros, &displs[i]);
+        }
+        MPI_Datatype type;
+        MPI_Type_create_hindexed(count, lengths, displs, MPI_BYTE, &type);
+        MPI_Type_commit(&type);
+        MPI_Send(MPI_BOTTOM, 1, type, dst, tag, payloadComm);
+        TRACE('S', dst, TAG_PAYLOAD, count * config.payload);
+        MPI_Type_free(&type);
+    }
+}
+
+static void chokerInit(Choker* ch, int numtasks)
+{
+    pthread_mutex_init(&ch->lock, NULL);
+    ch->periodStart = MPI_Wtime();
+    ch->optimistic = -1;
+    ch->slots = (size_t)numtasks;
+    ch->unchoked = (unsigned char*)calloc(ch->slots, 1);
+    ch->asked = (int*)calloc(numtasks, sizeof(int));
+    ch->gave = (int*)calloc(numtasks, sizeof(int));
+    ch->served = (int*)calloc(numtasks, sizeof(int));
+    DIE(!ch->unchoked || !ch->asked || !ch->gave || !ch->served, "calloc() failed!\n");
+}
+
+static void chokerFree(Choker* ch)
+{
+    pthread_mutex_destroy(&ch->lock);
+    free(ch->unchoked);
+    free(ch->asked);
+    free(ch->gave);
+    free(ch->served);
+}
+
+// descending order of the rechoke keys
+static int compareKeys(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// Choke decision, with ch->lock held. Tit-for-tat: of the ranks that asked us in the last
+// period, the config.uploadSlots - 1 that gave us the most segments stay unchoked (ties go
+// to the ones we served the least, so a seed rotates everybody); the last slot is the
+// optimistic unchoke, moved every OPTIMISTIC_ROUNDS to the next choked requester, which
+// lets a new peer earn its place. The counters start again from zero
+static void rechoke(Choker* ch, int numtasks, double now)
+{
+    uint64_t* keys = (uint64_t*)malloc(numtasks * sizeof(uint64_t));
+    DIE(keys == NULL, "malloc() failed!\n");
+    int interested = 0;
+    for (int r = 0; r < numtasks; r++) {
+        if (ch->asked[r] > 0) {
+            // gave, then fewest served (both saturated to 20 bits), then the rank, in one key
+            int gave = __atomic_load_n(&ch->gave[r], __ATOMIC_RELAXED);
+            uint64_t g = gave < 0xfffff ? (uint64_t)gave : 0xfffff;
+            uint64_t sv = ch->served[r] < 0xfffff ? (uint64_t)ch->served[r] : 0xfffff;
+            keys[interested++] = g << 44 | (0xfffff - sv) << 24 | (uint64_t)r;
+        }
+    }
+    qsort(keys, interested, sizeof(uint64_t), compareKeys);
+    memset(ch->unchoked, 0, ch->slots);
+    ch->unchokedCount = 0;
+    for (int i = 0; i < interested && ch->unchokedCount < config.uploadSlots - 1; i++) {
+        ch->unchoked[keys[i] & 0xffffff] = 1;
+        ch->unchokedCount++;
+    }
+    free(keys);
+    if (ch->rounds % OPTIMISTIC_ROUNDS == 0 || ch->optimistic < 0 || ch->unchoked[ch->optimistic]) {
+        // the next interested rank after the old one that is still choked
+        int start = ch->optimistic;
+        ch->optimistic = -1;
+        for (int i = 1; i <= numtasks; i++) {
+            int r = (start + i + numtasks) % numtasks;
+            if (ch->asked[r] > 0 && !ch->unchoked[r]) {
+                ch->optimistic = r;
+                break;
+            }
+        }
+    }
+    if (ch->optimistic >= 0 && !ch->unchoked[ch->optimistic]) {
+        ch->unchoked[ch->optimistic] = 1;
+        ch->unchokedCount++;
+    }
+    for (int r = 0; r < numtasks; r++) {
+        ch->asked[r] = 0;
+        ch->served[r] = 0;
+        __atomic_store_n(&ch->gave[r], 0, __ATOMIC_RELAXED);
+    }
+    ch->periodStart = now;
+    ch->rounds++;
+}
+
+// May rank be served now? A free slot goes to the first one asking; otherwise a choked
+// requester gets the time (microseconds) until the next decision in *retryUs
+static int chokeAdmit(Client* c, int rank, int* retryUs)
+{
+    Choker* ch = &c->choker;
+    double now = MPI_Wtime();
+    pthread_mutex_lock(&ch->lock);
+    if (now - ch->periodStart >= config.chokeUs * 1e-6) {
+        rechoke(ch, c->numtasks, now);
+    }
+    ch->asked[rank]++;
+    if (!ch->unchoked[rank] && ch->unchokedCount < config.uploadSlots) {
+        ch->unchoked[rank] = 1;
+        ch->unchokedCount++;
+    }
+    int ok = ch->unchoked[rank];
+    *retryUs = (int)((ch->periodStart + config.chokeUs * 1e-6 - now) * 1e6);
+    pthread_mutex_unlock(&ch->lock);
+    return ok;
+}
+
+// One upload worker: get a SEG_REQ from other clients (asks for segments i .. i + n - 1 from
+// file j) and answer it with a bitmap of the ones we have
+static void* upload_worker_func(void* arg)
+{
+    Client* c = (Client*)arg;
+    TRACE_ROLE('U');
+    // the answer with its PEX entries, grown for the largest file asked for
+    char* answer = NULL;
+    int answerSize = 0;
+    // payload mode: a segment of zeros for the holes of a partial answer
+    char* zeros = NULL;
+    // runs until peer() forwards the final signal from tracker as TAG_SHUTDOWN
+    while (1) {
+        // wait for a request or the shutdown
+        MPI_Message msg;
+        MPI_Status st;
+        idleMprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, segReqComm, &msg, &st);
+        if (st.MPI_TAG == TAG_SHUTDOWN) {
+            MPI_Mrecv(NULL, 0, MPI_BYTE, &msg, MPI_STATUS_IGNORE);
+            TRACE('R', st.MPI_SOURCE, TAG_SHUTDOWN, 0);
+            break;
+        }
+        // receave filename and index
+        SegRequest req;
+        MPI_Mrecv(&req, sizeof(req), MPI_BYTE, &msg, &st);
+        TRACE('R', st.MPI_SOURCE, TAG_SEG_REQ, sizeof(req));
+        METRIC(double servedAt = MPI_Wtime());
+        req.filename[MAX_FILENAME] = '\0';
+        int segIndex = req.segment;
+        int count = req.count >= 1 && req.count <= MAX_BATCH ? req.count : 1;
+        int depth = __atomic_fetch_add(&c->serving, 1, __ATOMIC_RELAXED);
+        int retryUs = 0;
+        int admitted = config.uploadSlots == 0 || chokeAdmit(c, st.MPI_SOURCE, &retryUs);
+
+        SegResponse resp;
+        memset(&resp, 0, sizeof(resp));
+        resp.segment = segIndex;
+        resp.fileId = req.fileId;
+        resp.queueDepth = depth;
+        // at first
+        strcpy(resp.status, admitted ? "NO" : "BSY");
+        resp.retryUs = admitted ? 0 : retryUs;
+        int answerLen = sizeof(resp);
+        // search for the file
+        const char* store = NULL;
+        pthread_rwlock_rdlock(&c->lock);
+        for (int i = 0; i < c->numFilesHave; i++) {
+            if (strcmp(c->haveFiles[i].filename, req.filename) == 0) {
+                // the valid indexes we have, none for a choked requester (it still gets the PEX)
+                for (int k = 0; k < count && admitted; k++) {
+                    int s = segIndex + k;
+                    if (s >= 0 && s < c->haveFiles[i].numSegments && isPresent(&c->haveFiles[i], s)) {
+                        resp.granted |= (uint64_t)1 << k;
+                    }
+                }
+                if (admitted && resp.granted == batchMask(count)) {
+                    strcpy(resp.status, "OK");
+                }
+                // a present segment is never written again, so it can be sent unlocked
+                store = c->haveFiles[i].store;
+                int need = sizeof(resp) + (config.pex + 1) * (sizeof(int) + bitfieldBytes(c->haveFiles[i].numSegments));
+                if (need > answerSize) {
+                    answer = (char*)realloc(answer, need);
+                    DIE(answer == NULL, "realloc() failed!\n");
+                    answerSize = need;
+                }
+                resp.pexCount = packPex(c, &c->haveFiles[i], st.MPI_SOURCE, answer, &answerLen);
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&c->lock);
+        // the data first (empty when nothing is granted), the downloader waits for it when the answer comes
+        if (config.payload > 0) {
+            if (store == NULL && admitted) {
+                resp.granted = 0;
+                strcpy(resp.status, "NO");
+            }
+            if (resp.granted != 0 && resp.granted != batchMask(count) && zeros == NULL) {
+                zeros = (char*)calloc(config.payload, 1);
+                DIE(zeros == NULL, "calloc() failed!\n");
+            }
+            sendSegments(store, segIndex, count, resp.granted, zeros, st.MPI_SOURCE, req.slot);
+        }
+        // Send the response
+        if (answerLen > (int)sizeof(resp)) {
+            memcpy(answer, &resp, sizeof(resp));
+            MPI_Send(answer, answerLen, MPI_BYTE, st.MPI_SOURCE, TAG_SEG_RSP, segRspComm);
+            TRACE('S', st.MPI_SOURCE, TAG_SEG_RSP, answerLen);
+        } else {
+            MPI_Send(&resp, sizeof(resp), MPI_BYTE, st.MPI_SOURCE, TAG_SEG_RSP, segRspComm);
+            TRACE('S', st.MPI_SOURCE, TAG_SEG_RSP, sizeof(resp));
+        }
+        __atomic_fetch_sub(&c->serving, 1, __ATOMIC_RELAXED);
+        if (config.uploadSlots > 0 && resp.granted != 0) {
+            pthread_mutex_lock(&c->choker.lock);
+            c->choker.served[st.MPI_SOURCE] += __builtin_popcountll(resp.granted);
+            pthread_mutex_unlock(&c->choker.lock);
+        }
+        METRIC(pthread_mutex_lock(&metricsLock));
+        METRIC(metrics.served++);
+        METRIC(metrics.busySent += !admitted);
+        METRIC(histAdd(&metrics.service, MPI_Wtime() - servedAt));
+        METRIC(pthread_mutex_unlock(&metricsLock));
+    }
+    free(answer);
+    free(zeros);
+    return NULL;
+}
+
+// used by seed or peer: runs config.uploadWorkers workers that serve requests in parallel
+void* upload_thread_func(void* arg)
+{
+    pthread_t workers[MAX_WORKERS];
+    for (int i = 0; i < config.uploadWorkers; i++) {
+        pthread_create(&workers[i], NULL, upload_worker_func, arg);
+    }
+    for (int i = 0; i < config.uploadWorkers; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    return NULL;
+}
+
+// Ask p->srank for p->count segments from p->segment of file without waiting. The request
+// goes with the persistent send of the slot, bound again only when the slot asks another
+// source; the answer lands in one of the idle persistent receives (active marks the started
+// ones) and is matched back by (source, file, segment). In payload mode the data is
+// received at its offset in the store (or in scratch when it is not NULL), with the slot as tag
+static void postSegmentRequest(Download* d, PendingRequest* p, int slot, MPI_Request* recvs, unsigned char* active, int window, char* scratch)
+{
+    memset(&p->msg, 0, sizeof(p->msg));
+    strncpy(p->msg.filename, d->info.filename, MAX_FILENAME);
+    p->msg.segment = p->segment;
+    p->msg.count = p->count;
+    p->msg.fileId = p->file;
+    p->msg.slot = slot;
+    if (config.payload > 0) {
+        p->into = scratch ? scratch : d->store + (size_t)p->segment * config.payload;
+        MPI_Irecv(p->into, p->count * config.payload, MPI_BYTE, p->srank, slot, payloadComm, &p->payload);
+    }
+    p->sentAt = MPI_Wtime();
+    METRIC(metrics.segRequests++);
+    if (p->sendTo != p->srank) {
+        if (p->send != MPI_REQUEST_NULL) {
+            MPI_Request_free(&p->send);
+        }
+        MPI_Send_init(&p->msg, sizeof(p->msg), MPI_BYTE, p->srank, TAG_SEG_REQ, segReqComm, &p->send);
+        p->sendTo = p->srank;
+    }
+    MPI_Start(&p->send);
+    TRACE('S', p->srank, TAG_SEG_REQ, sizeof(p->msg));
+    for (int i = 0; i < window; i++) {
+        if (!active[i]) {
+            MPI_Start(&recvs[i]);
+            active[i] = 1;
+            return;
+        }
+    }
+}
+
+// for every segment, how many of the known sources hold it
+static void countAvail(Download* d)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    for (int s = 0; s < d->info.numSegments; s++) {
+        d->avail[s] = d->seedCount;
+        for (int p = 0; p < d->peerCount; p++) {
+            d->avail[s] += bitGet(d->peerHave + (size_t)p * bytes, s);
+        }
+    }
+    d->blocked = 0;
+}
+
+// a peer became a seed, its bitfield is not needed anymore
+static void removePeer(Download* d, int rank)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    for (int p = 0; p < d->peerCount; p++) {
+        if (d->peers[p] == rank) {
+            d->peerCount--;
+            d->peers[p] = d->peers[d->peerCount];
+            memcpy(d->peerHave + (size_t)p * bytes, d->peerHave + (size_t)d->peerCount * bytes, bytes);
+            return;
+        }
+    }
+}
+
+// OR the segments rank holds into its bitfield, bits are only ever gained (the tracker
+// and the gossip may know different ones). An unknown rank becomes a peer; seeds and self
+// are left out. avail is kept up to date
+static void mergePeer(Download* d, int rank, const unsigned char* have, int self)
+{
+    if (rank == self) {
+        return;
+    }
+    for (int i = 0; i < d->seedCount; i++) {
+        if (d->seeds[i] == rank) {
+            return;
+        }
+    }
+    int bytes = bitfieldBytes(d->info.numSegments);
+    int p = 0;
+    while (p < d->peerCount && d->peers[p] != rank) {
+        p++;
+    }
+    unsigned char* mine = d->peerHave + (size_t)p * bytes;
+    if (p == d->peerCount) {
+        memset(mine, 0, bytes);
+        d->peers[d->peerCount++] = rank;
+    }
+    for (int b = 0; b < bytes; b++) {
+        unsigned char gained = have[b] & ~mine[b];
+        for (int s = b * 8; gained && s < d->info.numSegments; s++, gained >>= 1) {
+            if (gained & 1) {
+                d->avail[s]++;
+                d->blocked = 0;
+            }
+        }
+        mine[b] |= have[b];
+    }
+}
+
+// the PEX entries after an answer (see packPex)
+static void applyPex(Download* d, SegResponse* reply, int self)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    char* entry = (char*)(reply + 1);
+    for (int i = 0; i < reply->pexCount; i++) {
+        int rank;
+        memcpy(&rank, entry, sizeof(int));
+        mergePeer(d, rank, (unsigned char*)entry + sizeof(int), self);
+        entry += sizeof(int) + bytes;
+    }
+}
+
+// Merge packed sources (see packDelta) into d: the new seeds are appended, the peers
+// listed get the segments they announced. self is left out of the partial peers
+static void applySources(Download* d, char* buf, int size, int* pos, int self)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    unsigned char have[bytes];
+    int newSeeds;
+    MPI_Unpack(buf, size, pos, &d->version, 1, MPI_INT, MPI_COMM_WORLD);
+    MPI_Unpack(buf, size, pos, &newSeeds, 1, MPI_INT, MPI_COMM_WORLD);
+    if (newSeeds > 0) {
+        MPI_Unpack(buf, size, pos, d->seeds + d->seedCount, newSeeds, MPI_INT, MPI_COMM_WORLD);
+    }
+    for (int i = 0; i < newSeeds; i++) {
+        removePeer(d, d->seeds[d->seedCount++]);
+    }
+    int peerCount;
+    MPI_Unpack(buf, size, pos, &peerCount, 1, MPI_INT, MPI_COMM_WORLD);
+    for (int i = 0; i < peerCount; i++) {
+        int rank;
+        MPI_Unpack(buf, size, pos, &rank, 1, MPI_INT, MPI_COMM_WORLD);
+        MPI_Unpack(buf, size, pos, have, bytes, MPI_BYTE, MPI_COMM_WORLD);
+        mergePeer(d, rank, have, self);
+    }
+    countAvail(d);
+}
+
+// A TAG_SWARM_PUSH. It is used only when it is the next seed we expect, anything else is
+// left for the next swarm update
+static void applyPush(Download* downloads, int count, SwarmPush* push)
+{
+    push->filename[MAX_FILENAME] = '\0';
+    for (int f = 0; f < count; f++) {
+        Download* d = &downloads[f];
+        if (strcmp(d->info.filename, push->filename) != 0) {
+            continue;
+        }
+        if (push->index == d->seedCount && d->received < d->info.numSegments) {
+            removePeer(d, push->rank);
+            d->seeds[d->seedCount++] = push->rank;
+            countAvail(d);
+        }
+        return;
+    }
+}
+
+// Rarest first: the missing segment held by the fewest sources, -1 if none is held by anyone.
+// Every client starts the scan somewhere else, so equally rare segments are spread
+static int pickSegment(Download* d)
+{
+    int numSeg = d->info.numSegments;
+    int best = -1;
+    for (int i = 0; i < numSeg; i++) {
+        int s = (d->scanStart + i) % numSeg;
+        if (d->state[s] != SEG_MISSING || d->avail[s] == 0) {
+            continue;
+        }
+        if (best < 0 || d->avail[s] < d->avail[best]) {
+            best = s;
+            // can't get rarer than one source
+            if (d->avail[s] == 1) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+// The k-th source holding segment s: seeds first, then the peers that announced it
+static int nthHolder(Download* d, int s, int k)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    if (k < d->seedCount) {
+        return d->seeds[k];
+    }
+    k -= d->seedCount;
+    for (int p = 0; p < d->peerCount; p++) {
+        if (bitGet(d->peerHave + (size_t)p * bytes, s) && k-- == 0) {
+            return d->peers[p];
+        }
+    }
+    return -1;
+}
+
+// Expected wait for an answer from a source: its average latency (or guess when it never
+// answered) times the requests before ours, made worse by the share of "NO" answers
+static double sourceCost(SourceStats* st, double guess)
+{
+    double latency = st->latency > 0 ? st->latency : guess;
+    int queued = st->outstanding + (config.queueHint ? st->queueDepth : 0);
+    double yes = st->noRate < 0.9 ? 1.0 - st->noRate : 0.1;
+    return latency * (1 + queued) / yes;
+}
+
+// did rank say "NO" for segment s
+static int hasRefused(const Download* d, int s, int rank)
+{
+    for (int i = 0; i < d->refused[s]; i++) {
+        if (d->refusedBy[s][i] == rank) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A "NO" from rank for segment s (a bad copy counts too). Returns 1 while some holder of it
+// has not refused it yet, 0 once every distinct holder did
+static int refuseSegment(Download* d, int s, int rank)
+{
+    if (!hasRefused(d, s, rank)) {
+        int* by = (int*)realloc(d->refusedBy[s], (d->refused[s] + 1) * sizeof(int));
+        DIE(by == NULL, "realloc() failed!\n");
+        d->refusedBy[s] = by;
+        by[d->refused[s]++] = rank;
+    }
+    for (int k = 0; k < d->avail[s]; k++) {
+        if (!hasRefused(d, s, nthHolder(d, s, k))) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Source for segment s, never one that already said "NO" for it. With weighted sources
+// every other holder is drawn with a probability inversely proportional to its sourceCost.
+// Otherwise the next holder after the refusals, starting at a different one for every
+// segment. The holders that said they are busy for us are skipped, -1 when all of them did
+static int pickSource(Download* d, int s, SourceStats* stats, unsigned int* seed, double now)
+{
+    int holders = d->avail[s];
+    if (!config.weightedSources) {
+        for (int i = 0; i < holders; i++) {
+            int r = nthHolder(d, s, (s + d->refused[s] + i) % holders);
+            if (!hasRefused(d, s, r) && stats[r].busyUntil <= now) {
+                return r;
+            }
+        }
+        return -1;
+    }
+    // a source that never answered is assumed as fast as the average of the others
+    double known = 0;
+    int knownCount = 0;
+    for (int k = 0; k < holders; k++) {
+        SourceStats* st = &stats[nthHolder(d, s, k)];
+        if (st->latency > 0) {
+            known += st->latency;
+            knownCount++;
+        }
+    }
+    double guess = knownCount > 0 ? known / knownCount : 1e-3;
+    double weights[holders];
+    double total = 0;
+    for (int k = 0; k < holders; k++) {
+        int r = nthHolder(d, s, k);
+        weights[k] = hasRefused(d, s, r) || stats[r].busyUntil > now ? 0 : 1.0 / sourceCost(&stats[r], guess);
+        total += weights[k];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    double x = total * rand_r(seed) / ((double)RAND_MAX + 1);
+    for (int k = 0; k < holders; k++) {
+        if (x < weights[k]) {
+            return nthHolder(d, s, k);
+        }
+        x -= weights[k];
+    }
+    return nthHolder(d, s, holders - 1);
+}
+
+// fold an answer into the statistics of its source
+static void recordAnswer(SourceStats* st, double latency, int no, int queueDepth)
+{
+    st->latency = st->latency > 0 ? (1 - STATS_ALPHA) * st->latency + STATS_ALPHA * latency : latency;
+    st->noRate = (1 - STATS_ALPHA) * st->noRate + STATS_ALPHA * no;
+    st->queueDepth = queueDepth;
+}
+
+// The file that gets the next request: the one closest to completion that still has
+// segments never asked for, so finished files are announced (and seeded) sooner
+static int pickDownload(Download* downloads, int count, double now)
+{
+    int best = -1;
+    for (int f = 0; f < count; f++) {
+        Download* d = &downloads[f];
+        if (d->failed || d->blocked || d->unasked == 0 || d->chokedUntil > now) {
+            continue;
+        }
+        if (best < 0 || d->info.numSegments - d->received < downloads[best].info.numSegments - downloads[best].received) {
+            best = f;
+        }
+    }
+    return best;
+}
+
+// does p ask for segment of file
+static int covers(PendingRequest* p, int file, int segment)
+{
+    return p->segment >= 0 && p->file == file && segment >= p->segment && segment < p->segment + p->count;
+}
+
+// requests in flight for segment of file, without skip
+static int copiesInFlight(PendingRequest* pending, int window, int file, int segment, PendingRequest* skip)
+{
+    int copies = 0;
+    for (int i = 0; i < window; i++) {
+        if (&pending[i] != skip && covers(&pending[i], file, segment)) {
+            copies++;
+        }
+    }
+    return copies;
+}
+
+// Endgame: nothing is left to ask for the first time, so a free slot asks again for a
+// segment already in flight of a file with at most config.endgame segments missing. The
+// segment with the fewest copies, from its cheapest holder not asked yet; the first OK
+// wins and the other copies are ignored when they answer. Returns the file, -1 if none
+static int pickDuplicate(Download* downloads, PendingRequest* pending, int window, SourceStats* stats,
+                         int* segment, int* srank, double now)
+{
+    int best = -1;
+    int bestCopies = 0;
+    double bestCost = 0;
+    for (int i = 0; i < window; i++) {
+        if (pending[i].segment < 0) {
+            continue;
+        }
+        int f = pending[i].file;
+        Download* d = &downloads[f];
+        if (d->failed || d->unasked > 0 || d->info.numSegments - d->received > config.endgame) {
+            continue;
+        }
+        for (int s = pending[i].segment; s < pending[i].segment + pending[i].count; s++) {
+            if (d->state[s] != SEG_ASKED) {
+                continue;
+            }
+            int copies = copiesInFlight(pending, window, f, s, NULL);
+            if (copies >= ENDGAME_COPIES || (best >= 0 && copies > bestCopies)) {
+                continue;
+            }
+            for (int k = 0; k < d->avail[s]; k++) {
+                int r = nthHolder(d, s, k);
+                int asked = 0;
+                for (int j = 0; j < window; j++) {
+                    asked |= covers(&pending[j], f, s) && pending[j].srank == r;
+                }
+                double cost = sourceCost(&stats[r], 1e-3);
+                if (!asked && !hasRefused(d, s, r) && stats[r].busyUntil <= now && (best < 0 || copies < bestCopies || cost < bestCost)) {
+                    best = f;
+                    bestCopies = copies;
+                    bestCost = cost;
+                    *segment = s;
+                    *srank = r;
+                }
+            }
+        }
+    }
+    return best;
+}
+
+// the scratch buffer of a slot, grown to at least size bytes
+static char* slotScratch(char** scratch, size_t* scratchSize, int slot, size_t size)
+{
+    if (scratchSize[slot] < size) {
+        free(scratch[slot]);
+        scratch[slot] = (char*)malloc(size);
+        DIE(scratch[slot] == NULL, "malloc() failed!\n");
+        scratchSize[slot] = size;
+    }
+    return scratch[slot];
+}
+
+// Payload mode: segment of file was won by a copy whose data is at data, in scratch. The
+// other requests for it still receiving into the store are cancelled and received into
+// their own scratch instead (or waited for, when their data is already coming), so nothing
+// writes there anymore; then the winning data is copied in
+static void claimStore(Download* d, int file, int segment, const char* data, PendingRequest* pending, int window,
+                       char** scratch, size_t* scratchSize)
+{
+    size_t size = config.payload;
+    for (int i = 0; i < window; i++) {
+        PendingRequest* q = &pending[i];
+        if (!covers(q, file, segment) || q->into != d->store + q->segment * size || q->payload == MPI_REQUEST_NULL) {
+            continue;
+        }
+        MPI_Status st;
+        int cancelled;
+        MPI_Cancel(&q->payload);
+        MPI_Wait(&q->payload, &st);
+        MPI_Test_cancelled(&st, &cancelled);
+        if (cancelled) {
+            // the same source and tag, the slot is not reused before its answer
+            q->into = slotScratch(scratch, scratchSize, i, q->count * size);
+            MPI_Irecv(q->into, q->count * config.payload, MPI_BYTE, q->srank, i, payloadComm, &q->payload);
+        } else {
+            MPI_Get_count(&st, MPI_BYTE, &q->bytes);
+            TRACE('R', q->srank, TAG_PAYLOAD, q->bytes);
+        }
+    }
+    memcpy(d->store + segment * size, data, size);
+}
+
+// publish the segments we have of d and get the seeds/peers changed since d->version
+static void updateSwarm(Client* c, Download* d)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    int size = packedSize(MAX_FILENAME + 1, MPI_CHAR) + packedSize(2, MPI_INT) + packedSize(bytes, MPI_BYTE);
+    char* request = (char*)malloc(size);
+    unsigned char* have = (unsigned char*)calloc(bytes, 1);
+    DIE(request == NULL || have == NULL, "malloc() failed!\n");
+    for (int s = 0; s < d->info.numSegments; s++) {
+        if (d->state[s] == SEG_DONE) {
+            bitSet(have, s);
+        }
+    }
+    int pos = 0;
+    MPI_Pack(d->info.filename, MAX_FILENAME + 1, MPI_CHAR, request, size, &pos, MPI_COMM_WORLD);
+    MPI_Pack(&d->version, 1, MPI_INT, request, size, &pos, MPI_COMM_WORLD);
+    MPI_Pack(&d->seedCount, 1, MPI_INT, request, size, &pos, MPI_COMM_WORLD);
+    MPI_Pack(have, bytes, MPI_BYTE, request, size, &pos, MPI_COMM_WORLD);
+    MPI_Send(request, pos, MPI_PACKED, trackerOf(d->info.filename), TAG_WANT_UPDATE, swarmComm);
+    TRACE('S', trackerOf(d->info.filename), TAG_WANT_UPDATE, pos);
+    METRIC(metrics.swarmUpdates++);
+    free(request);
+    free(have);
+
+    MPI_Status st;
+    int replySize;
+    char* reply = recvPacked(trackerOf(d->info.filename), TAG_FILE_INFO, &replySize, &st);
+    int replyPos = 0;
+    pthread_rwlock_wrlock(&c->lock);
+    applySources(d, reply, replySize, &replyPos, c->rank);
+    pthread_rwlock_unlock(&c->lock);
+    free(reply);
+}
+
+// d is complete: save it, drop its checkpoint and tell the tracker we are a seed of it
+static void fileDone(Client* c, Download* d)
+{
+    saveFile(c, d->haveIndex);
+    closeCheckpoint(c, d, 1);
+    // say to the tracker add client to the list
+    MPI_Send(d->info.filename, MAX_FILENAME + 1, MPI_CHAR, trackerOf(d->info.filename), TAG_FILE_DONE, swarmComm);
+    TRACE('S', trackerOf(d->info.filename), TAG_FILE_DONE, MAX_FILENAME + 1);
+    c->doneSent[trackerOf(d->info.filename)]++;
+    benchEvent("file_done", c->rank, d->info.filename);
+}
+
+// MPI_Waitany that gives up at wakeAt (MPI_Wtime, 0 waits for ever) with polls and short
+// sleeps, returns 0 when it gave up
+static int waitAnswer(int count, MPI_Request* recvs, int* idx, MPI_Status* st, double wakeAt)
+{
+    if (wakeAt == 0) {
+        MPI_Waitany(count, recvs, idx, st);
+        return 1;
+    }
+    while (1) {
+        int flag = 0;
+        MPI_Testany(count, recvs, idx, &flag, st);
+        if (flag && *idx != MPI_UNDEFINED) {
+            return 1;
+        }
+        double left = wakeAt - MPI_Wtime();
+        if (left <= 0) {
+            return 0;
+        }
+        long pauseUs = left * 1e6 < 100 ? (long)(left * 1e6) + 1 : 100;
+        struct timespec ts = { 0, pauseUs * 1000 };
+        nanosleep(&ts, NULL);
+    }
+}
+
+// the bitfield of rank among the peers of d, NULL when it is not a peer (a seed)
+static const unsigned char* peerBits(Download* d, int rank)
+{
+    int bytes = bitfieldBytes(d->info.numSegments);
+    for (int p = 0; p < d->peerCount; p++) {
+        if (d->peers[p] == rank) {
+            return d->peerHave + (size_t)p * bytes;
+        }
+    }
+    return NULL;
+}
+
+// One-sided mode, collective over the clients once every wanted file has its partial entry:
+// the present bitsets move to the shared segment behind the directory (the entries point
+// there from now on), then the segment and the stores are attached to dataWin
+static void rmaExpose(Client* c, Download* downloads, int count)
+{
+    Rma* rma = &c->rma;
+    MPI_Comm_split_type(clientComm, MPI_COMM_TYPE_SHARED, c->rank, MPI_INFO_NULL, &rma->nodeComm);
+    MPI_Aint bitsAt = (sizeof(RmaDir) + (MPI_Aint)c->numFilesHave * sizeof(RmaEntry) + 7) & ~(MPI_Aint)7;
+    rma->segmentSize = bitsAt;
+    for (int i = 0; i < c->numFilesHave; i++) {
+        rma->segmentSize += presentWords(c->haveFiles[i].numSegments) * sizeof(uint64_t);
+    }
+    // every segment on its own pages, only its owner writes it
+    MPI_Info info;
+    MPI_Info_create(&info);
+    MPI_Info_set(info, "alloc_shared_noncontig", "true");
+    MPI_Win_allocate_shared(rma->segmentSize, 1, info, rma->nodeComm, &rma->segment, &rma->shmWin);
+    MPI_Info_free(&info);
+
+    RmaDir* dir = (RmaDir*)rma->segment;
+    pthread_rwlock_wrlock(&c->lock);
+    dir->count = c->numFilesHave;
+    for (int i = 0; i < c->numFilesHave; i++) {
+        File* f = &c->haveFiles[i];
+        RmaEntry* e = &dir->entries[i];
+        int words = presentWords(f->numSegments);
+        memset(e, 0, sizeof(*e));
+        strcpy(e->filename, f->filename);
+        e->numSegments = f->numSegments;
+        e->bits = bitsAt;
+        if (f->store) {
+            MPI_Get_address(f->store, &e->store);
+        }
+        uint64_t* bits = (uint64_t*)(rma->segment + bitsAt);
+        memcpy(bits, f->present, words * sizeof(uint64_t));
+        free(f->present);
+        f->present = bits;
+        bitsAt += words * sizeof(uint64_t);
+    }
+    for (int f = 0; f < count; f++) {
+        downloads[f].info.present = c->haveFiles[downloads[f].haveIndex].present;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    // plain loads and stores on the segments from now on
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, rma->shmWin);
+    MPI_Win_sync(rma->shmWin);
+
+    MPI_Win_create_dynamic(MPI_INFO_NULL, clientComm, &rma->dataWin);
+    MPI_Win_attach(rma->dataWin, rma->segment, rma->segmentSize);
+    for (int i = 0; i < c->numFilesHave; i++) {
+        if (c->haveFiles[i].store) {
+            MPI_Win_attach(rma->dataWin, c->haveFiles[i].store, (MPI_Aint)c->haveFiles[i].numSegments * config.payload);
+        }
+    }
+    // where the segment of every client is and who shares our node; client k of clientComm is rank trackers + k
+    rma->segBase = (MPI_Aint*)calloc(c->numtasks, sizeof(MPI_Aint));
+    rma->nodeRank = (int*)malloc(c->numtasks * sizeof(int));
+    rma->dirs = (RmaDir**)calloc(c->numtasks, sizeof(RmaDir*));
+    DIE(!rma->segBase || !rma->nodeRank || !rma->dirs, "malloc() failed!\n");
+    MPI_Aint base;
+    MPI_Get_address(rma->segment, &base);
+    // the directories are written before anybody reads them
+    MPI_Allgather(&base, 1, MPI_AINT, rma->segBase + config.trackers, 1, MPI_AINT, clientComm);
+    MPI_Win_sync(rma->shmWin);
+    int nodeSize;
+    MPI_Comm_size(rma->nodeComm, &nodeSize);
+    int* local = (int*)malloc(nodeSize * sizeof(int));
+    int* world = (int*)malloc(nodeSize * sizeof(int));
+    DIE(local == NULL || world == NULL, "malloc() failed!\n");
+    MPI_Group nodeGroup, worldGroup;
+    MPI_Comm_group(rma->nodeComm, &nodeGroup);
+    MPI_Comm_group(MPI_COMM_WORLD, &worldGroup);
+    for (int i = 0; i < nodeSize; i++) {
+        local[i] = i;
+    }
+    MPI_Group_translate_ranks(nodeGroup, nodeSize, local, worldGroup, world);
+    for (int r = 0; r < c->numtasks; r++) {
+        rma->nodeRank[r] = -1;
+    }
+    for (int i = 0; i < nodeSize; i++) {
+        rma->nodeRank[world[i]] = i;
+    }
+    MPI_Group_free(&nodeGroup);
+    MPI_Group_free(&worldGroup);
+    free(local);
+    free(world);
+}
+
+// collective over the clients, after the last MPI_Get of everybody
+static void rmaClose(Client* c)
+{
+    Rma* rma = &c->rma;
+    for (int i = 0; i < c->numFilesHave; i++) {
+        if (c->haveFiles[i].store) {
+            MPI_Win_detach(rma->dataWin, c->haveFiles[i].store);
+        }
+        // freed with the segment
+        c->haveFiles[i].present = NULL;
+    }
+    MPI_Win_detach(rma->dataWin, rma->segment);
+    MPI_Win_free(&rma->dataWin);
+    MPI_Win_unlock_all(rma->shmWin);
+    MPI_Win_free(&rma->shmWin);
+    MPI_Comm_free(&rma->nodeComm);
+    for (int r = 0; r < c->numtasks; r++) {
+        if (rma->nodeRank[r] < 0) {
+            free(rma->dirs[r]);
+        }
+    }
+    free(rma->dirs);
+    free(rma->nodeRank);
+    free(rma->segBase);
+}
+
+// The directory of a client: its shared segment when it is on our node, otherwise a copy
+// got once with MPI_Get (the directory never changes, only the bitsets behind it)
+static RmaDir* rmaDir(Rma* rma, int rank)
+{
+    if (rma->dirs[rank] != NULL) {
+        return rma->dirs[rank];
+    }
+    if (rma->nodeRank[rank] >= 0) {
+        MPI_Aint size;
+        int unit;
+        MPI_Win_shared_query(rma->shmWin, rma->nodeRank[rank], &size, &unit, &rma->dirs[rank]);
+        return rma->dirs[rank];
+    }
+    int target = rank - config.trackers;
+    MPI_Aint count;
+    MPI_Get(&count, 1, MPI_AINT, target, rma->segBase[rank], 1, MPI_AINT, rma->dataWin);
+    MPI_Win_flush(target, rma->dataWin);
+    int size = sizeof(RmaDir) + count * sizeof(RmaEntry);
+    RmaDir* dir = (RmaDir*)malloc(size);
+    DIE(dir == NULL, "malloc() failed!\n");
+    MPI_Get(dir, size, MPI_BYTE, target, rma->segBase[rank], size, MPI_BYTE, rma->dataWin);
+    MPI_Win_flush(target, rma->dataWin);
+    rma->dirs[rank] = dir;
+    return dir;
+}
+
+// One-sided request: reads which of the p->count segments from p->segment p->srank holds
+// (plain loads on our node) and, in payload mode, gets them at their offset in the store
+// with one MPI_Get per run. Done when it returns, the answer is made up in reply as if
+// p->srank had sent it
+static void rmaFetch(Client* c, Download* d, PendingRequest* p, SegResponse* reply)
+{
+    Rma* rma = &c->rma;
+    int target = p->srank - config.trackers;
+    p->send = MPI_REQUEST_NULL;
+    p->payload = MPI_REQUEST_NULL;
+    p->into = d->store ? d->store + (size_t)p->segment * config.payload : NULL;
+    p->bytes = 0;
+    p->sentAt = MPI_Wtime();
+    METRIC(metrics.segRequests++);
+    memset(reply, 0, sizeof(*reply));
+    reply->fileId = p->file;
+    reply->segment = p->segment;
+    strcpy(reply->status, "NO");
+
+    RmaDir* dir = rmaDir(rma, p->srank);
+    RmaEntry* e = NULL;
+    for (int i = 0; i < dir->count; i++) {
+        if (strcmp(dir->entries[i].filename, d->info.filename) == 0 && dir->entries[i].numSegments == d->info.numSegments) {
+            e = &dir->entries[i];
+            break;
+        }
+    }
+    if (e == NULL) {
+        return;
+    }
+    // the (at most two) words of the bitset with the asked segments
+    int first = p->segment / 64;
+    int words = (p->segment + p->count - 1) / 64 - first + 1;
+    uint64_t bits[2];
+    if (rma->nodeRank[p->srank] >= 0) {
+        const uint64_t* present = (const uint64_t*)((char*)dir + e->bits);
+        for (int w = 0; w < words; w++) {
+            bits[w] = __atomic_load_n(&present[first + w], __ATOMIC_ACQUIRE);
+        }
+    } else {
+        MPI_Get(bits, words, MPI_UINT64_T, target, rma->segBase[p->srank] + e->bits + first * sizeof(uint64_t), words,
+                MPI_UINT64_T, rma->dataWin);
+        MPI_Win_flush(target, rma->dataWin);
+    }
+    uint64_t granted = 0;
+    for (int k = 0; k < p->count; k++) {
+        int s = p->segment + k;
+        granted |= ((bits[s / 64 - first] >> (s % 64)) & 1) << k;
+    }
+    if (config.payload > 0) {
+        if (e->store == 0 || p->into == NULL) {
+            granted = 0;
+        }
+        for (int k = 0; k < p->count;) {
+            if (!((granted >> k) & 1)) {
+                k++;
+                continue;
+            }
+            int run = 1;
+            while (k + run < p->count && ((granted >> (k + run)) & 1)) {
+                run++;
+            }
+            MPI_Get(p->into + (size_t)k * config.payload, run * config.payload, MPI_BYTE, target,
+                    e->store + (MPI_Aint)(p->segment + k) * config.payload, run * config.payload, MPI_BYTE, rma->dataWin);
+            k += run;
+        }
+        if (granted != 0) {
+            MPI_Win_flush(target, rma->dataWin);
+        }
+        p->bytes = p->count * config.payload;
+    }
+    reply->granted = granted;
+    if (granted == batchMask(p->count)) {
+        strcpy(reply->status, "OK");
+    }
+}
+
+// The run asked from srank for segment: the missing segments around it that srank holds
+// too, config.batch at most, marked SEG_ASKED. Returns its length, *first is where it starts
+static int claimRun(Download* d, int segment, int srank, int batch, int* first)
+{
+    const unsigned char* bits = peerBits(d, srank);
+    int lo = segment;
+    int hi = segment;
+    while (hi - lo + 1 < batch && hi + 1 < d->info.numSegments && d->state[hi + 1] == SEG_MISSING
+           && (bits == NULL || bitGet(bits, hi + 1))) {
+        hi++;
+    }
+    while (hi - lo + 1 < batch && lo > 0 && d->state[lo - 1] == SEG_MISSING && (bits == NULL || bitGet(bits, lo - 1))) {
+        lo--;
+    }
+    memset(d->state + lo, SEG_ASKED, hi - lo + 1);
+    d->unasked -= hi - lo + 1;
+    *first = lo;
+    return hi - lo + 1;
+}
+
+// Download all the wanted files at the same time. At most config.requestWindow requests
+// are in flight in total; free slots go to the file closest to completion and, inside it,
+// to its rarest segment together with the missing segments next to it that the same source
+// holds (config.batch at most), or to endgame copies once every segment was asked. A file
+// is saved and announced with TAG_FILE_DONE as soon as its last segment arrives. In the
+// one-sided mode a request is done with MPI_Get when its slot is filled and its answer is
+// handled like a received one
+static void runDownloads(Client* c, Download* downloads, int count)
+{
+    int window = config.requestWindow;
+    // in payload mode a request also stays under 1GB of data
+    int batch = config.batch;
+    if (config.payload > 0 && batch > (1 << 30) / config.payload) {
+        batch = (1 << 30) / config.payload;
+    }
+    size_t segSize = config.payload;
+    PendingRequest pending[MAX_WINDOW];
+    // payload mode: where the endgame copies of every slot are received, allocated when needed
+    char* scratch[MAX_WINDOW] = { NULL };
+    size_t scratchSize[MAX_WINDOW] = { 0 };
+    // persistent receives of the answers, then the one of TAG_SWARM_PUSH
+    MPI_Request recvs[MAX_WINDOW + 1];
+    unsigned char active[MAX_WINDOW] = { 0 };
+    // room for config.pex entries of the largest file, 8 bytes aligned
+    int replySize = sizeof(SegResponse);
+    for (int f = 0; f < count; f++) {
+        int size = sizeof(SegResponse) + config.pex * (sizeof(int) + bitfieldBytes(downloads[f].info.numSegments));
+        replySize = size > replySize ? size : replySize;
+    }
+    replySize = (replySize + 7) & ~7;
+    char* replies = (char*)malloc((size_t)window * replySize);
+    DIE(replies == NULL, "malloc() failed!\n");
+    SwarmPush push;
+    for (int i = 0; i < window; i++) {
+        pending[i].segment = -1;
+        pending[i].send = MPI_REQUEST_NULL;
+        pending[i].sendTo = -1;
+        MPI_Recv_init(replies + (size_t)i * replySize, replySize, MPI_BYTE, MPI_ANY_SOURCE, TAG_SEG_RSP, segRspComm, &recvs[i]);
+    }
+    recvs[window] = MPI_REQUEST_NULL;
+    if (config.swarmPush) {
+        MPI_Recv_init(&push, sizeof(push), MPI_BYTE, MPI_ANY_SOURCE, TAG_SWARM_PUSH, swarmComm, &recvs[window]);
+        MPI_Start(&recvs[window]);
+    }
+    int inFlight = 0;
+    SourceStats* stats = (SourceStats*)calloc(c->numtasks, sizeof(SourceStats));
+    DIE(stats == NULL, "calloc() failed!\n");
+    unsigned int seed = (unsigned int)c->rank;
+    if (config.rma) {
+        MPI_Win_lock_all(0, c->rma.dataWin);
+    }
+
+    while (1) {
+        // fill the window, only sources that hold a segment are asked for it
+        double now = MPI_Wtime();
+        for (int i = 0; i < window; i++) {
+            if (pending[i].segment != -1) {
+                continue;
+            }
+            int f = pickDownload(downloads, count, now);
+            if (f < 0) {
+                int segment, srank;
+                // no endgame copies in the one-sided mode, nothing stays in flight
+                f = config.endgame > 0 && !config.rma ? pickDuplicate(downloads, pending, window, stats, &segment, &srank, now) : -1;
+                if (f < 0) {
+                    break;
+                }
+                pending[i].file = f;
+                pending[i].segment = segment;
+                pending[i].count = 1;
+                pending[i].srank = srank;
+                postSegmentRequest(&downloads[f], &pending[i], i, recvs, active, window,
+                                   config.payload > 0 ? slotScratch(scratch, scratchSize, i, segSize) : NULL);
+                stats[srank].outstanding++;
+                inFlight++;
+                METRIC(metrics.segDuplicates++);
+                continue;
+            }
+            Download* d = &downloads[f];
+            int segment = pickSegment(d);
+            if (segment < 0) {
+                // wait for the next swarm update of this file
+                d->blocked = 1;
+                i--;
+                continue;
+            }
+            int srank = pickSource(d, segment, stats, &seed, now);
+            if (srank < 0) {
+                // every holder that didn't refuse it is choking us, the file waits until the
+                // first of them decides again
+                d->chokedUntil = 0;
+                for (int k = 0; k < d->avail[segment]; k++) {
+                    int r = nthHolder(d, segment, k);
+                    double until = stats[r].busyUntil;
+                    if (!hasRefused(d, segment, r)) {
+                        d->chokedUntil = d->chokedUntil == 0 || until < d->chokedUntil ? until : d->chokedUntil;
+                    }
+                }
+                if (d->chokedUntil == 0) {
+                    // a swarm update left only holders that refused it
+                    d->failed = 1;
+                }
+                i--;
+                continue;
+            }
+            pending[i].file = f;
+            pending[i].count = claimRun(d, segment, srank, batch, &pending[i].segment);
+            pending[i].srank = srank;
+            if (config.rma) {
+                rmaFetch(c, d, &pending[i], (SegResponse*)(replies + (size_t)i * replySize));
+            } else {
+                postSegmentRequest(d, &pending[i], i, recvs, active, window, NULL);
+            }
+            stats[srank].outstanding++;
+            inFlight++;
+        }
+        // the earliest time a choked file can be asked again
+        double wakeAt = 0;
+        for (int f = 0; f < count; f++) {
+            Download* d = &downloads[f];
+            if (!d->failed && d->unasked > 0 && d->chokedUntil > now && (wakeAt == 0 || d->chokedUntil < wakeAt)) {
+                wakeAt = d->chokedUntil;
+            }
+        }
+        if (inFlight == 0 && wakeAt == 0) {
+            break;
+        }
+        // wait for any answer or a new seed, until wakeAt if some file is choked
+        int idx;
+        MPI_Status st;
+        if (config.rma) {
+            // the answers are there already, a new seed goes first
+            int flag = 0;
+            if (recvs[window] != MPI_REQUEST_NULL) {
+                MPI_Test(&recvs[window], &flag, &st);
+            }
+            idx = window;
+            if (!flag) {
+                for (idx = 0; pending[idx].segment < 0; idx++) {
+                }
+                st.MPI_SOURCE = pending[idx].srank;
+            }
+        } else if (!waitAnswer(window + 1, recvs, &idx, &st, wakeAt)) {
+            continue;
+        }
+        if (idx == window) {
+            TRACE('R', st.MPI_SOURCE, TAG_SWARM_PUSH, sizeof(push));
+            c->pushes++;
+            pthread_rwlock_wrlock(&c->lock);
+            applyPush(downloads, count, &push);
+            pthread_rwlock_unlock(&c->lock);
+            MPI_Start(&recvs[window]);
+            continue;
+        }
+        SegResponse* reply = (SegResponse*)(replies + (size_t)idx * replySize);
+        active[idx] = 0;
+#ifdef TEMA2_TRACE
+        if (!config.rma) {
+            int answerLen;
+            MPI_Get_count(&st, MPI_BYTE, &answerLen);
+            TRACE('R', st.MPI_SOURCE, TAG_SEG_RSP, answerLen);
+        }
+#endif
+
+        PendingRequest* req = NULL;
+        for (int i = 0; i < window; i++) {
+            if (pending[i].segment == reply->segment && pending[i].file == reply->fileId && pending[i].srank == st.MPI_SOURCE) {
+                req = &pending[i];
+                break;
+            }
+        }
+        DIE(req == NULL, "unmatched segment response");
+        MPI_Wait(&req->send, MPI_STATUS_IGNORE);
+        inFlight--;
+        Download* d = &downloads[req->file];
+        uint64_t granted = reply->granted & batchMask(req->count);
+        int busy = strcmp(reply->status, "BSY") == 0;
+        if (config.payload > 0) {
+            // a segment only counts once its data arrived and matches the hash
+            if (req->payload != MPI_REQUEST_NULL) {
+                MPI_Status payloadSt;
+                MPI_Wait(&req->payload, &payloadSt);
+                MPI_Get_count(&payloadSt, MPI_BYTE, &req->bytes);
+                TRACE('R', req->srank, TAG_PAYLOAD, req->bytes);
+            }
+            for (int k = 0; k < req->count; k++) {
+                int s = req->segment + k;
+                if (!((granted >> k) & 1) || d->state[s] == SEG_DONE) {
+                    continue;
+                }
+                if (req->bytes < (k + 1) * config.payload || !checkSegment(req->into + k * segSize, config.payload, d->info.digests[s])) {
+                    fprintf(stderr, "Client %d: bad data for segment %d of %s from %d\n", c->rank, s, d->info.filename, req->srank);
+                    granted &= ~((uint64_t)1 << k);
+                }
+            }
+        }
+        stats[req->srank].outstanding--;
+        if (busy) {
+            // choked: the segments go to other sources, this one is skipped until it decides again
+            stats[req->srank].busyUntil = MPI_Wtime() + reply->retryUs * 1e-6;
+            METRIC(metrics.segBusy++);
+        } else {
+            recordAnswer(&stats[req->srank], MPI_Wtime() - req->sentAt, granted == 0, reply->queueDepth);
+        }
+        METRIC(histAdd(&metrics.rtt, MPI_Wtime() - req->sentAt));
+        if (reply->pexCount > 0) {
+            pthread_rwlock_wrlock(&c->lock);
+            applyPex(d, reply, c->rank);
+            pthread_rwlock_unlock(&c->lock);
+        }
+
+        // endgame copies won with their data aside, it goes to the store first
+        if (config.payload > 0 && req->into != d->store + req->segment * segSize) {
+            for (int k = 0; k < req->count; k++) {
+                if (((granted >> k) & 1) && d->state[req->segment + k] != SEG_DONE) {
+                    claimStore(d, req->file, req->segment + k, req->into + k * segSize, pending, window, scratch, scratchSize);
+                }
+            }
+        }
+        File* target = &c->haveFiles[d->haveIndex];
+        int before = d->received;
+        for (int k = 0; k < req->count; k++) {
+            int s = req->segment + k;
+            if (d->state[s] == SEG_DONE) {
+                // endgame: another copy won already
+                METRIC(metrics.segWasted++);
+            } else if ((granted >> k) & 1) {
+                // got a valid segment, so increment the counter
+                pthread_rwlock_wrlock(&c->lock);
+                setPresent(target, s);
+                pthread_rwlock_unlock(&c->lock);
+                if (config.rma) {
+                    // the data and the bit, in this order, for the node (shmWin) and the MPI_Get of the others
+                    MPI_Win_sync(c->rma.shmWin);
+                    MPI_Win_sync(c->rma.dataWin);
+                }
+                d->state[s] = SEG_DONE;
+                d->received++;
+                checkpointSegment(d, s);
+                METRIC(metrics.segOk++);
+            } else {
+                METRIC(metrics.segNo += !busy);
+                if (copiesInFlight(pending, window, req->file, s, req) > 0) {
+                    // an endgame copy is still out, it decides
+                    continue;
+                }
+                if (busy || refuseSegment(d, s, req->srank)) {
+                    // asked again, from a source holding it that didn't refuse it
+                    d->state[s] = SEG_MISSING;
+                    d->unasked++;
+                    d->blocked = 0;
+                } else {
+                    // nobody gives it, no complete file; what is still in flight is drained
+                    d->failed = 1;
+                }
+            }
+        }
+        req->segment = -1;
+        if (d->received > before && config.uploadSlots > 0) {
+            // tit-for-tat: what this source gave us counts at our own choke decisions
+            __atomic_fetch_add(&c->choker.gave[req->srank], d->received - before, __ATOMIC_RELAXED);
+        }
+        if (d->received > before) {
+            if (presentCount(target) == d->info.numSegments) {
+                fileDone(c, d);
+            } else if (config.swarmUpdate > 0 && d->received / config.swarmUpdate != before / config.swarmUpdate) {
+                // after each config.swarmUpdate downloaded segments update the swarm
+                updateSwarm(c, d);
+            }
+        }
+    }
+    // the pushes still coming are received by peer() after TAG_FINISH
+    if (recvs[window] != MPI_REQUEST_NULL) {
+        MPI_Status st;
+        int cancelled;
+        MPI_Cancel(&recvs[window]);
+        MPI_Wait(&recvs[window], &st);
+        MPI_Test_cancelled(&st, &cancelled);
+        c->pushes += !cancelled;
+        if (!cancelled) {
+            TRACE('R', st.MPI_SOURCE, TAG_SWARM_PUSH, sizeof(push));
+        }
+        MPI_Request_free(&recvs[window]);
+    }
+    // nothing is in flight anymore, every persistent request is idle
+    for (int i = 0; i < window; i++) {
+        MPI_Request_free(&recvs[i]);
+        if (pending[i].send != MPI_REQUEST_NULL) {
+            MPI_Request_free(&pending[i].send);
+        }
+    }
+    if (config.rma) {
+        MPI_Win_unlock_all(c->rma.dataWin);
+    }
+    for (int i = 0; i < window; i++) {
+        free(scratch[i]);
+    }
+    free(replies);
+    free(stats);
+}
+
+// Set d up from a TAG_FILE_INFO answer, once its name and numSeg are unpacked: the digests,
+// the sources and every segment missing
+static void initDownload(Client* c, Download* d, const char* name, int numSeg, char* info, int infoSize, int* infoPos)
+{
+    strcpy(d->info.filename, name);
+    allocSegments(&d->info, numSeg);
+
+    // the digests
+    unpackDigests(info, infoSize, infoPos, d->info.digests[0], numSeg, &d->info.upper);
+
+    // sources sized for the largest lists the swarm updates can bring
+    d->seeds = (int*)malloc(c->numtasks * sizeof(int));
+    d->peers = (int*)malloc(c->numtasks * sizeof(int));
+    d->peerHave = (unsigned char*)malloc((size_t)c->numtasks * bitfieldBytes(numSeg));
+    d->avail = (int*)calloc(numSeg, sizeof(int));
+    d->state = (unsigned char*)calloc(numSeg, 1);
+    d->refused = (int*)calloc(numSeg, sizeof(int));
+    d->refusedBy = (int**)calloc(numSeg, sizeof(int*));
+    DIE(!d->seeds || !d->peers || !d->peerHave || !d->avail || !d->state || !d->refused || !d->refusedBy, "malloc() failed!\n");
+    d->unasked = numSeg;
+    d->scanStart = (int)((unsigned)c->rank * 2654435761u % (unsigned)numSeg);
+    // seeds, peers and what each peer has
+    applySources(d, info, infoSize, infoPos, c->rank);
+}
+
+static void* download_thread_func(void* arg)
+{
+    Client* c = (Client*)arg;
+    TRACE_ROLE('D');
+    // send to every tracker the owned files it is in charge of, in one message (maybe with
+    // no files): number of files, then for each of them the filename, number of segments
+    // and the digests
+    for (int k = 0; k < config.trackers; k++) {
+        int size = packedSize(1, MPI_INT);
+        int mine = 0;
+        for (int i = 0; i < c->numFilesHave; i++) {
+            if (trackerOf(c->haveFiles[i].filename) == k) {
+                size += manifestSize(c->haveFiles[i].numSegments);
+                mine++;
+            }
+        }
+        char* inventory = (char*)malloc(size);
+        DIE(inventory == NULL, "malloc() failed!\n");
+        int pos = 0;
+        MPI_Pack(&mine, 1, MPI_INT, inventory, size, &pos, MPI_COMM_WORLD);
+        for (int i = 0; i < c->numFilesHave; i++) {
+            if (trackerOf(c->haveFiles[i].filename) != k) {
+                continue;
+            }
+            MPI_Pack(c->haveFiles[i].filename, MAX_FILENAME + 1, MPI_CHAR, inventory, size, &pos, MPI_COMM_WORLD);
+            MPI_Pack(&c->haveFiles[i].numSegments, 1, MPI_INT, inventory, size, &pos, MPI_COMM_WORLD);
+            packDigests(c->haveFiles[i].digests[0], c->haveFiles[i].numSegments, c->haveFiles[i].upper, inventory, size, &pos);
+        }
+        MPI_Send(inventory, pos, MPI_PACKED, k, TAG_INIT_FILES, swarmComm);
+        TRACE('S', k, TAG_INIT_FILES, pos);
+        free(inventory);
+    }
+    // wait for the ACK of every tracker
+    for (int k = 0; k < config.trackers; k++) {
+        char ack[4];
+        MPI_Recv(ack, 4, MPI_CHAR, k, TAG_INIT_ACK, swarmComm, MPI_STATUS_IGNORE);
+        TRACE('R', k, TAG_INIT_ACK, 4);
+    }
+    // confirmation received.
+    // ask for every wanted file at once (TAG_WANT_FILE); the answers TAG_FILE_INFO contain the name,
+    // number of segments and hashes and come as soon as the file is registered, in any order.
+    // After that all of them are downloaded together
+    Download* downloads = (Download*)calloc(c->numFilesWant > 0 ? c->numFilesWant : 1, sizeof(Download));
+    DIE(downloads == NULL, "calloc() failed!\n");
+    int count = 0;
+    for (int f = 0; f < c->numFilesWant; f++) {
+        char wantedName[MAX_FILENAME + 1];
+        strncpy(wantedName, c->wantFiles[f], MAX_FILENAME);
+        wantedName[MAX_FILENAME] = '\0';
+        // ask the tracker for swarm information, list of seeds/peers
+        MPI_Send(wantedName, MAX_FILENAME + 1, MPI_CHAR, trackerOf(wantedName), TAG_WANT_FILE, swarmComm);
+        TRACE('S', trackerOf(wantedName), TAG_WANT_FILE, MAX_FILENAME + 1);
+    }
+    for (int f = 0; f < c->numFilesWant; f++) {
+        // receave, all in one message: name, number of segments, hashes, number of seeds and seeds
+        MPI_Status st;
+        int infoSize;
+        char* info = recvPacked(MPI_ANY_SOURCE, TAG_FILE_INFO, &infoSize, &st);
+        int infoPos = 0;
+        char wantedName[MAX_FILENAME + 1];
+        int numSeg;
+        MPI_Unpack(info, infoSize, &infoPos, wantedName, MAX_FILENAME + 1, MPI_CHAR, MPI_COMM_WORLD);
+        wantedName[MAX_FILENAME] = '\0';
+        MPI_Unpack(info, infoSize, &infoPos, &numSeg, 1, MPI_INT, MPI_COMM_WORLD);
+        // no file found
+        if (numSeg <= 0) {
+            free(info);
+            continue;
+        }
+        // used to simulate the download
+        Download* d = &downloads[count++];
+        initDownload(c, d, wantedName, numSeg, info, infoSize, &infoPos);
+        free(info);
+        // actualizez fisierele pe care le am: the file is partially owned while downloading,
+        // segments are marked as received by runDownloads
+        // the entry shares the arrays of d->info and frees them at the end; the present
+        // bits come with the segments
+        // a checkpoint of an earlier run gives the segments it verified, the rest is downloaded
+        File* old = findResumed(c, d);
+        d->info.store = openStore(c->rank, d->info.filename, d->info.numSegments, old != NULL);
+        d->store = d->info.store;
+        if (old != NULL) {
+            resumeDownload(d, old);
+        }
+        openCheckpoint(c, d, old != NULL);
+        pthread_rwlock_wrlock(&c->lock);
+        d->haveIndex = c->numFilesHave;
+        c->haveFiles[d->haveIndex] = d->info;
+        c->haveFiles[d->haveIndex].download = d;
+        c->numFilesHave++;
+        pthread_rwlock_unlock(&c->lock);
+    }
 
-typedef struct {
-    int rank;
-    int numFilesHave;
-    File haveFiles[MAX_FILES];
-    int numFilesWant;
-    char wantFiles[MAX_FILES][MAX_FILENAME + 1];
-    // for download thread
-    int downloadFinished;
-    // final from tracker
-    int final;
-} Client;
+    if (c->resumed) {
+        freeFiles(c->resumed, c->numFilesWant);
+        c->resumed = NULL;
+    }
+    // the resumed files join their swarms as peers with what they hold (or as seeds)
+    for (int f = 0; f < count; f++) {
+        Download* d = &downloads[f];
+        if (d->received == d->info.numSegments) {
+            fileDone(c, d);
+        } else if (d->received > 0) {
+            updateSwarm(c, d);
+        }
+    }
+    if (config.rma) {
+        rmaExpose(c, downloads, count);
+    }
+    runDownloads(c, downloads, count);
+    // the upload workers stop gossiping the sources of the downloads
+    pthread_rwlock_wrlock(&c->lock);
+    for (int f = 0; f < count; f++) {
+        c->haveFiles[downloads[f].haveIndex].download = NULL;
+    }
+    pthread_rwlock_unlock(&c->lock);
+    for (int f = 0; f < count; f++) {
+        // what a failed download got stays for the next run
+        closeCheckpoint(c, &downloads[f], 0);
+        free(downloads[f].seeds);
+        free(downloads[f].peers);
+        free(downloads[f].peerHave);
+        free(downloads[f].avail);
+        free(downloads[f].state);
+        for (int s = 0; s < downloads[f].info.numSegments; s++) {
+            free(downloads[f].refusedBy[s]);
+        }
+        free(downloads[f].refused);
+        free(downloads[f].refusedBy);
+    }
+    free(downloads);
 
-// Files for tracker
-typedef struct {
-    char filename[MAX_FILENAME + 1];
-    int  numSegments;
-    char hashes[MAX_CHUNKS][HASH_SIZE + 1];
-    // Array of clients' ids that have completed files
-    int seeds[MAX_CLIENTS]; 
-    int seedCount;
-} Tracker;
+    // TAG_ALL_DONE
+    MPI_Send(c->doneSent, config.trackers, MPI_INT, homeTracker(c->rank), TAG_ALL_DONE,swarmComm);
+    TRACE('S', homeTracker(c->rank), TAG_ALL_DONE, config.trackers * (int)sizeof(int));
+    c->downloadFinished = 1;
+    benchEvent("all_done", c->rank, NULL);
+    return NULL;
+}
 
-static void strip_newline(char *s)
+static void* arenaAlloc(Arena* a, size_t size)
 {
-    size_t len = strlen(s);
-    while (len > 0 && s[len - 1] == '\n' ) {
-        s[len - 1] = '\0';
-        len--;
+    // keep every allocation 16 bytes aligned
+    size = (size + 15) & ~(size_t)15;
+    ArenaBlock* b = a->head;
+    if (b == NULL || b->size - b->used < size) {
+        size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        b = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize + 15);
+        DIE(b == NULL, "malloc() failed!\n");
+        // first aligned byte of data
+        b->used = (16 - (uintptr_t)b->data % 16) % 16;
+        b->size = blockSize + b->used;
+        b->next = a->head;
+        a->head = b;
     }
+    void* ptr = b->data + b->used;
+    b->used += size;
+    memset(ptr, 0, size);
+    return ptr;
 }
 
-// Parse in<R>.txt
-static FileConstructor* parseFile(const char *file_name)
+static void arenaFree(Arena* a)
 {
-    FILE* file = fopen(file_name,"r");
-    if (!file) {
-        fprintf(stderr,"Cannot open %s\n", file_name);
-        return NULL;
+    while (a->head) {
+        ArenaBlock* next = a->head->next;
+        free(a->head);
+        a->head = next;
     }
-    FileConstructor* file_constructor = (FileConstructor*)calloc(1, sizeof(FileConstructor));
-    DIE(file_constructor == NULL,"calloc() failed!\n");
-    // number of files that the client have
-    char line[LINE_SIZE];
-    if(!fgets(line, sizeof(line), file)){
-        fprintf(stderr,"Error reading number of files!\n");
-        fclose(file); 
-        free(file_constructor);
-        return NULL;
+}
+
+static void catalogInit(Catalog* cat, int numtasks)
+{
+    memset(cat, 0, sizeof(Catalog));
+    cat->capacity = 16;
+    cat->files = (Tracker*)malloc(cat->capacity * sizeof(Tracker));
+    DIE(cat->files == NULL, "malloc() failed!\n");
+    cat->tableSize = 32;
+    cat->table = (int*)malloc(cat->tableSize * sizeof(int));
+    DIE(cat->table == NULL, "malloc() failed!\n");
+    memset(cat->table, -1, cat->tableSize * sizeof(int));
+    cat->setWords = (numtasks + 63) / 64;
+    cat->numtasks = numtasks;
+}
+
+// slot of name in the table: where it is, or the free slot where it would go
+static int catalogSlot(Catalog* cat, const char* name, unsigned int key)
+{
+    int mask = cat->tableSize - 1;
+    for (int i = key & mask; ; i = (i + 1) & mask) {
+        int idx = cat->table[i];
+        if (idx < 0 || (cat->files[idx].key == key && strcmp(cat->files[idx].filename, name) == 0)) {
+            return i;
+        }
     }
+}
 
-    strip_newline(line);
-    file_constructor->numFilesHave = atoi(line);
+static Tracker* catalogFind(Catalog* cat, const char* name)
+{
+    int idx = cat->table[catalogSlot(cat, name, nameHash(name))];
+    return idx < 0 ? NULL : &cat->files[idx];
+}
 
-    for (int i = 0 ; i < file_constructor->numFilesHave; i++) {
-        if (!fgets(line, sizeof(line), file)) {
-            fprintf(stderr,"Error! \n");
-            fclose(file); 
-            free(file_constructor);
-            return NULL;
+// Register a new file, the returned entry stays valid until the next catalogAdd
+static Tracker* catalogAdd(Catalog* cat, const char* name, int numSegments)
+{
+    // keep the table at most half full
+    if (2 * (cat->count + 1) > cat->tableSize) {
+        free(cat->table);
+        cat->tableSize *= 2;
+        cat->table = (int*)malloc(cat->tableSize * sizeof(int));
+        DIE(cat->table == NULL, "malloc() failed!\n");
+        memset(cat->table, -1, cat->tableSize * sizeof(int));
+        for (int i = 0; i < cat->count; i++) {
+            cat->table[catalogSlot(cat, cat->files[i].filename, cat->files[i].key)] = i;
         }
-        strip_newline(line);
+    }
+    if (cat->count == cat->capacity) {
+        cat->capacity *= 2;
+        cat->files = (Tracker*)realloc(cat->files, cat->capacity * sizeof(Tracker));
+        DIE(cat->files == NULL, "realloc() failed!\n");
+    }
+    Tracker* t = &cat->files[cat->count];
+    memset(t, 0, sizeof(Tracker));
+    size_t len = strlen(name);
+    char* interned = (char*)arenaAlloc(&cat->arena, len + 1);
+    memcpy(interned, name, len + 1);
+    t->filename = interned;
+    t->key = nameHash(name);
+    t->numSegments = numSegments;
+    t->digests = (unsigned char*)arenaAlloc(&cat->arena, (size_t)numSegments * DIGEST_SIZE);
+    t->seedSet = (uint64_t*)arenaAlloc(&cat->arena, cat->setWords * sizeof(uint64_t));
+    t->subscribed = (uint64_t*)arenaAlloc(&cat->arena, cat->setWords * sizeof(uint64_t));
+    cat->table[catalogSlot(cat, name, t->key)] = cat->count++;
+    return t;
+}
 
-        char array[MAX_FILENAME + 1];
-        int segments_count;
-        if (sscanf(line,"%s %d", array,&segments_count) < 2 || sscanf(line,"%s %d", array,&segments_count) > 2) {
-            fprintf(stderr,"Format error! \n");
-            fclose(file); 
-            free(file_constructor);
-            return NULL;
+// Add rank to the seeds of t, returns 0 when it was already there
+static int addSeed(Catalog* cat, Tracker* t, int rank)
+{
+    uint64_t bit = (uint64_t)1 << (rank % 64);
+    if (t->seedSet[rank / 64] & bit) {
+        return 0;
+    }
+    t->seedSet[rank / 64] |= bit;
+    if (t->seedCount == t->seedCapacity) {
+        // the old array stays in the arena, doubling keeps the waste bounded
+        int capacity = t->seedCapacity ? 2 * t->seedCapacity : 4;
+        int* seeds = (int*)arenaAlloc(&cat->arena, capacity * sizeof(int));
+        if (t->seedCount > 0) {
+            memcpy(seeds, t->seeds, t->seedCount * sizeof(int));
         }
+        t->seeds = seeds;
+        t->seedCapacity = capacity;
+    }
+    t->seeds[t->seedCount++] = rank;
+    t->version++;
+    return 1;
+}
 
-        strncpy(file_constructor->haveFiles[i].filename, array, MAX_FILENAME);
-        file_constructor->haveFiles[i].numSegments = segments_count;
+static int isSeed(Tracker* t, int rank)
+{
+    return (t->seedSet[rank / 64] >> (rank % 64)) & 1;
+}
 
-        for(int s = 0; s < segments_count; s++) {
-            if (!fgets(line, sizeof(line), file)) {
-                fprintf(stderr,"Error reading segment! \n");
-                fclose(file); 
-                free(file_constructor);
-                return NULL;
+// Remember the segments a downloading client has, returns 1 if that changed anything
+static int setPeerHave(Catalog* cat, Tracker* t, int rank, const unsigned char* have)
+{
+    int bytes = bitfieldBytes(t->numSegments);
+    // seeds have everything
+    if (isSeed(t, rank)) {
+        return 0;
+    }
+    if (t->peerSlot == NULL) {
+        t->peerSlot = (int*)arenaAlloc(&cat->arena, cat->numtasks * sizeof(int));
+    }
+    if (t->peerSlot[rank] == 0) {
+        if (t->peerCount == t->peerCapacity) {
+            int capacity = t->peerCapacity ? 2 * t->peerCapacity : 4;
+            PartialPeer* peers = (PartialPeer*)arenaAlloc(&cat->arena, capacity * sizeof(PartialPeer));
+            if (t->peerCount > 0) {
+                memcpy(peers, t->peers, t->peerCount * sizeof(PartialPeer));
             }
-            strip_newline(line);
-            strncpy(file_constructor->haveFiles[i].segments[s].hash, line, HASH_SIZE);
+            t->peers = peers;
+            t->peerCapacity = capacity;
         }
+        PartialPeer* p = &t->peers[t->peerCount++];
+        p->rank = rank;
+        p->have = (unsigned char*)arenaAlloc(&cat->arena, bytes);
+        t->peerSlot[rank] = t->peerCount;
     }
-
-    // number wanted files
-    if(!fgets(line, sizeof(line), file)){
-        fprintf(stderr,"Error! \n");
-        fclose(file);
-        free(file_constructor);
-        return NULL;
+    PartialPeer* p = &t->peers[t->peerSlot[rank] - 1];
+    if (memcmp(p->have, have, bytes) == 0) {
+        return 0;
     }
-    strip_newline(line);
-    file_constructor->numFilesWant = atoi(line);
+    memcpy(p->have, have, bytes);
+    p->version = ++t->version;
+    return 1;
+}
 
-    // wanted files
-    for (int i = 0; i < file_constructor->numFilesWant; i++) {
-        if (!fgets(line,sizeof(line),file)){
-            fprintf(stderr,"Error reading wanted files!\n");
-            fclose(file); 
-            free(file_constructor);
-            return NULL;
+// Packed sources changed after version since: the version, number of new seeds, the seeds
+// from index seedsKnown on, number of peers, then rank and bitfield of each peer updated
+// after since. Peers that became seeds and skip are left out. (0, 0) is the whole list and
+// an empty delta is the "no change" answer
+static int deltaSize(Tracker* t, int seedsKnown)
+{
+    int bytes = bitfieldBytes(t->numSegments);
+    return 3 * packedSize(1, MPI_INT) + packedSize(t->seedCount - seedsKnown, MPI_INT)
+         + t->peerCount * (packedSize(1, MPI_INT) + packedSize(bytes, MPI_BYTE));
+}
+
+static void packDelta(Tracker* t, int since, int seedsKnown, int skip, char* buf, int size, int* pos)
+{
+    int bytes = bitfieldBytes(t->numSegments);
+    int newSeeds = t->seedCount - seedsKnown;
+    MPI_Pack(&t->version, 1, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+    MPI_Pack(&newSeeds, 1, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+    if (newSeeds > 0) {
+        MPI_Pack(t->seeds + seedsKnown, newSeeds, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+    }
+    int peerCount = 0;
+    for (int i = 0; i < t->peerCount; i++) {
+        PartialPeer* p = &t->peers[i];
+        peerCount += p->version > since && p->rank != skip && !isSeed(t, p->rank);
+    }
+    MPI_Pack(&peerCount, 1, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+    for (int i = 0; i < t->peerCount; i++) {
+        PartialPeer* p = &t->peers[i];
+        if (p->version > since && p->rank != skip && !isSeed(t, p->rank)) {
+            MPI_Pack(&p->rank, 1, MPI_INT, buf, size, pos, MPI_COMM_WORLD);
+            MPI_Pack(p->have, bytes, MPI_BYTE, buf, size, pos, MPI_COMM_WORLD);
         }
-        strip_newline(line);
-        strncpy(file_constructor->wantFiles[i], line, MAX_FILENAME);
     }
-
-    fclose(file);
-    return file_constructor;
 }
-// For initialization, at first the client reads the input file and take information from it
-static Client* initClient(int rank)
-{
-    char file_name[MAX_FILENAME];
-    snprintf(file_name, sizeof(file_name), "in%d.txt", rank);
 
-    FileConstructor* fc = parseFile(file_name);
-    if (!fc) {
-        return NULL;
+// Tell the subscribed downloaders of t that rank is its newest seed; pushed counts the
+// pushes of every client, they get the total with TAG_FINISH
+static void pushSeed(Catalog* cat, Tracker* t, int rank, int* pushed)
+{
+    SwarmPush push;
+    memset(&push, 0, sizeof(push));
+    strncpy(push.filename, t->filename, MAX_FILENAME);
+    push.index = t->seedCount - 1;
+    push.rank = rank;
+    for (int w = 0; w < cat->setWords; w++) {
+        for (uint64_t bits = t->subscribed[w]; bits; bits &= bits - 1) {
+            int r = w * 64 + __builtin_ctzll(bits);
+            MPI_Send(&push, sizeof(push), MPI_BYTE, r, TAG_SWARM_PUSH, swarmComm);
+            TRACE('S', r, TAG_SWARM_PUSH, sizeof(push));
+            pushed[r]++;
+        }
     }
+}
 
-    Client* c = (Client*)calloc(1, sizeof(Client));
-    DIE(c == NULL,"calloc() failed!\n");
-    
-    c->rank = rank;
-    c->numFilesHave = fc->numFilesHave;
-    memcpy(c->haveFiles, fc->haveFiles, sizeof(fc->haveFiles));
-    c->numFilesWant= fc->numFilesWant;
-    memcpy(c->wantFiles, fc->wantFiles, sizeof(fc->wantFiles));
-    c->downloadFinished = 0;
-    c->final = 0;
+// Build the packed TAG_FILE_INFO answer: name, number of segments, digests and the sources.
+// The name comes first since the answers of a client's requests may arrive in any order
+static void packInfo(Tracker* t)
+{
+    int size = packedSize(MAX_FILENAME + 1, MPI_CHAR) + packedSize(1, MPI_INT)
+             + digestsSize(t->numSegments) + deltaSize(t, 0);
+    t->info = (char*)malloc(size);
+    DIE(t->info == NULL, "malloc() failed!\n");
+    char name[MAX_FILENAME + 1] = { 0 };
+    strncpy(name, t->filename, MAX_FILENAME);
+    int pos = 0;
+    MPI_Pack(name, MAX_FILENAME + 1, MPI_CHAR, t->info, size, &pos, MPI_COMM_WORLD);
+    MPI_Pack(&t->numSegments, 1, MPI_INT, t->info, size, &pos, MPI_COMM_WORLD);
+    packDigests(t->digests, t->numSegments, t->upper, t->info, size, &pos);
+    packDelta(t, 0, 0, -1, t->info, size, &pos);
+    t->infoSize = pos;
+}
 
-    free(fc);
-    return c;
+// the sources changed, the cached answer is stale
+static void invalidateInfo(Tracker* t)
+{
+    free(t->info);
+    t->info = NULL;
+    t->infoSize = 0;
 }
 
-// Save the file in this format clientR_<filename>
-static void saveFile(Client* c, int file_index)
+static void catalogFree(Catalog* cat)
 {
-    char out_name[64];
-    snprintf(out_name, sizeof(out_name), "client%d_%s", c->rank, c->haveFiles[file_index].filename);
+    for (int i = 0; i < cat->count; i++) {
+        invalidateInfo(&cat->files[i]);
+    }
+    free(cat->files);
+    free(cat->table);
+    arenaFree(&cat->arena);
+}
 
-    FILE* file = fopen(out_name,"w");
-    if (!file) {
-        fprintf(stderr,"Can't open %s\n", out_name);
+// Answer a TAG_WANT_FILE: the cached info of t, or the name and 0 segments when t is NULL
+static void sendFileInfo(Tracker* t, const char* fname, int dst)
+{
+    if (t == NULL) {
+        char buf[64];
+        int pos = 0;
+        MPI_Pack(fname, MAX_FILENAME + 1, MPI_CHAR, buf, sizeof(buf), &pos, MPI_COMM_WORLD);
+        int zero = 0;
+        MPI_Pack(&zero, 1, MPI_INT, buf, sizeof(buf), &pos, MPI_COMM_WORLD);
+        MPI_Send(buf, pos, MPI_PACKED, dst, TAG_FILE_INFO, swarmComm);
+        TRACE('S', dst, TAG_FILE_INFO, pos);
         return;
     }
-    // save the ordered list of hashes
-    for (int s = 0; s < c->haveFiles[file_index].numSegments; s++) {
-        fprintf(file,"%s\n", c->haveFiles[file_index].segments[s].hash);
+    //send, the packed answer is reused until the seeds list changes
+    if (t->info == NULL) {
+        packInfo(t);
+    }
+    MPI_Send(t->info, t->infoSize, MPI_PACKED, dst, TAG_FILE_INFO, swarmComm);
+    TRACE('S', dst, TAG_FILE_INFO, t->infoSize);
+    // the new seeds will be pushed to it while it downloads
+    if (config.swarmPush) {
+        t->subscribed[dst / 64] |= (uint64_t)1 << (dst % 64);
     }
-    fclose(file);
 }
 
-// used by seed or peer. get a SEG_REQ from other clients(asks for segment i from file j)
-void* upload_thread_func(void* arg)
+// A TAG_WANT_FILE for a file no client registered yet, answered once one does or, if
+// none has it, when every client is registered
+typedef struct {
+    int rank;
+    char filename[MAX_FILENAME + 1];
+} Waiter;
+
+// Add the files of a TAG_INIT_FILES inventory of client c to the catalog
+static void registerFiles(Catalog* cat, int c, char* inventory, int size, int* pushed)
 {
-    Client* c = (Client*)arg;
-    // we don t have the final signal from tracker
-    while (!c->final) {
-        // wait for a request
-        MPI_Status st;
-        int flag = 0;
-        // in order to stop blocking the execution
-        MPI_Iprobe(MPI_ANY_SOURCE, TAG_SEG_REQ, MPI_COMM_WORLD, &flag, &st);
-        if (flag == 0) {
-            continue;
-        }
-        // receave filename and index
-        char file_name[MAX_FILENAME + 1];
-        int segIndex = -1;
+    int numHave;
+    int pos = 0;
+    MPI_Unpack(inventory, size, &pos, &numHave, 1, MPI_INT, MPI_COMM_WORLD);
+
+    for (int i = 0; i < numHave; i++) {
+        char fname[MAX_FILENAME + 1];
+        int segCount;
+        MPI_Unpack(inventory, size, &pos, fname, MAX_FILENAME + 1, MPI_CHAR, MPI_COMM_WORLD);
+        MPI_Unpack(inventory, size, &pos, &segCount, 1, MPI_INT, MPI_COMM_WORLD);
 
-        MPI_Recv(file_name, MAX_FILENAME + 1, MPI_CHAR, st.MPI_SOURCE, TAG_SEG_REQ, MPI_COMM_WORLD, &st);
-        MPI_Recv(&segIndex, 1, MPI_INT, st.MPI_SOURCE, TAG_SEG_REQ, MPI_COMM_WORLD, &st);
+        fname[MAX_FILENAME] = '\0';
         // search for the file
-        int ok = -1;
-        for (int i = 0; i < c->numFilesHave; i++) {
-            if (strcmp(c->haveFiles[i].filename, file_name) == 0) {
-                ok = i;
-                break;
-            }
+        Tracker* t = catalogFind(cat, fname);
+        if (t == NULL) {
+            t = catalogAdd(cat, fname, segCount);
         }
-        char resp[6];
-        // at first
-        strcpy(resp, "NO");
-        if (ok != -1) {
-            // valid index
-            if (segIndex >= 0 && segIndex < c->haveFiles[ok].numSegments && c->haveFiles[ok].segments[segIndex].hash[0] != '\0') {
-                // we have index
-                strcpy(resp, "OK");
-            }
+        // digests, save in the catalog; an owner announcing another size is ignored
+        if (segCount == t->numSegments) {
+            unpackDigests(inventory, size, &pos, t->digests, segCount, &t->upper);
+        } else {
+            fprintf(stderr, "Client %d has %s with %d segments instead of %d\n", c, fname, segCount, t->numSegments);
+            unsigned char* skip = (unsigned char*)malloc((size_t)segCount * DIGEST_SIZE + 1);
+            DIE(skip == NULL, "malloc() failed!\n");
+            int upper;
+            unpackDigests(inventory, size, &pos, skip, segCount, &upper);
+            free(skip);
+            continue;
+        }
+
+        // add client to seeds; downloads may have started already, they hear about it
+        if (addSeed(cat, t, c)) {
+            invalidateInfo(t);
+            pushSeed(cat, t, c, pushed);
         }
-        // Send the response
-        MPI_Send(resp, 10, MPI_CHAR, st.MPI_SOURCE, TAG_SEG_RSP, MPI_COMM_WORLD);
     }
-    return NULL;
 }
 
-static void* download_thread_func(void* arg)
+// Wait for a message to the tracker or for the end of the completion reduction, polling
+// both with the backoff of idleMprobe. Returns 0 when the reduction ended first
+static int probeOrReduced(MPI_Request* reduction, MPI_Status* st)
 {
-    Client* c = (Client*)arg;
-    // send to the tracker owned files : number of segments and the hashes
-    MPI_Send(&c->numFilesHave, 1, MPI_INT, TRACKER_RANK, TAG_INIT_FILES, MPI_COMM_WORLD);
-    for (int i = 0; i < c->numFilesHave; i++) {
-        // send filename
-        MPI_Send(c->haveFiles[i].filename, MAX_FILENAME + 1, MPI_CHAR, TRACKER_RANK, TAG_INIT_FILES, MPI_COMM_WORLD);
-        // send numSegments
-        MPI_Send(&c->haveFiles[i].numSegments, 1, MPI_INT, TRACKER_RANK, TAG_INIT_FILES, MPI_COMM_WORLD);
-        // send hash
-        for (int s = 0; s < c->haveFiles[i].numSegments; s++) {
-            MPI_Send(c->haveFiles[i].segments[s].hash, HASH_SIZE + 1, MPI_CHAR, TRACKER_RANK, TAG_INIT_FILES, MPI_COMM_WORLD);
-        }
-    }
-    // wait for ACK
-    char ack[4];
-    MPI_Recv(ack, 4, MPI_CHAR, TRACKER_RANK, TAG_INIT_ACK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-    // confirmation received.
-    // for every wanted file ask the tracker (TAG_WANT_FILE) and get answer TAG_FILE_INFO which contains number of segments and hashes. After that we try the download
-    for (int f = 0; f < c->numFilesWant; f++) {
-        char wantedName[MAX_FILENAME + 1];
-        strncpy(wantedName, c->wantFiles[f], MAX_FILENAME);
-        // ask the tracker for swarm information, list of seeds/peers
-        MPI_Send(wantedName, MAX_FILENAME + 1, MPI_CHAR, TRACKER_RANK, TAG_WANT_FILE, MPI_COMM_WORLD);
-        // receave
-        MPI_Status st;
-        int numSeg;
-        MPI_Recv(&numSeg, 1, MPI_INT, TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, &st);
-        // no file found
-        if (numSeg <= 0) {
-            continue;
+    long pauseUs = 1;
+    for (int polls = 0; ; polls++) {
+        int flag = 0;
+        MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, swarmComm, &flag, st);
+        if (flag) {
+            return 1;
         }
-        // used to simulate the download
-        File localFile; 
-        memset(&localFile, 0, sizeof(localFile));
-        strncpy(localFile.filename, wantedName, MAX_FILENAME);
-        localFile.numSegments = numSeg;
-
-        // the hashes  
-        for (int s = 0; s < numSeg; s++) {
-            MPI_Recv(localFile.segments[s].hash, HASH_SIZE + 1, MPI_CHAR,
-                     TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, &st);
-            }
-        // Receive seeds and number of seeds
-        int seedCount;
-        MPI_Recv(&seedCount, 1, MPI_INT, TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, &st);
-
-        int seeds[seedCount];
-        if (seedCount > 0) {
-            MPI_Recv(seeds, seedCount, MPI_INT, TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, &st);
-        }
-        // contor for downloaded segments
-        int counter = 0;
-        // download segment
-        // actualizez fisierele pe care le am
-        c->numFilesHave++;
-        strcpy(c->haveFiles[c->numFilesHave-1].filename, localFile.filename);
-        c->haveFiles[c->numFilesHave-1].numSegments = localFile.numSegments;
-        for (int i = 0; i < localFile.numSegments; i++) {
-            c->haveFiles[c->numFilesHave - 1].segments[i].hash[0] = '\0';
-        }
-        for (int segment = 0; segment < numSeg; segment++) {
-            int ok = 0;
-            // load seeds/peers in a ciclic way for eficiency
-            for(int seed = 0; seed < seedCount; seed++) {
-                int srank = seeds[(segment + seed) % seedCount];
-                // ask for segment
-                MPI_Send(wantedName, MAX_FILENAME + 1, MPI_CHAR, srank, TAG_SEG_REQ, MPI_COMM_WORLD);
-                MPI_Send(&segment, 1, MPI_INT, srank, TAG_SEG_REQ, MPI_COMM_WORLD);
-
-                char resp[10];
-                MPI_Recv(resp, 10, MPI_CHAR, srank, TAG_SEG_RSP, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                // got a valid response, so increment the counter
-                if (strcmp(resp, "OK") == 0) {
-                    ok = 1;
-                    counter++;
-                    strcpy(c->haveFiles[c->numFilesHave - 1].segments[segment].hash, localFile.segments[segment].hash);
-                    break;
-                }
-            }
-            // no complete file
-            if (ok == 0) {
-                break;
-            }
-            // after each 10 downloaded segments update the swarm
-            if (counter % 10 == 0) {
-            MPI_Send(wantedName, MAX_FILENAME + 1, MPI_CHAR, TRACKER_RANK, TAG_WANT_UPDATE, MPI_COMM_WORLD);
-            // updated seeds list
-            MPI_Recv(&seedCount, 1, MPI_INT, TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            if (seedCount > 0) {
-                MPI_Recv(seeds, seedCount, MPI_INT, TRACKER_RANK, TAG_FILE_INFO, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                }
-            }
+        MPI_Test(reduction, &flag, MPI_STATUS_IGNORE);
+        if (flag) {
+            return 0;
         }
-        // check the number of segments
-        int final_number = 0;
-        for(int s = 0; s < numSeg; s++) {
-            if (strlen(localFile.segments[s].hash) > 0) {
-                final_number++;
-            }
+        if (polls < IDLE_SPIN || config.idleMaxUs == 0) {
+            continue;
         }
-        // Finalize downloading file
-        if (final_number == numSeg) {
-            // complete, save, add to have list files
-            int index = f;
-            c->haveFiles[index] = localFile;
-            saveFile(c, index);
-
-            // say to the tracker add client to the list
-            MPI_Send(wantedName, MAX_FILENAME + 1, MPI_CHAR, TRACKER_RANK, TAG_FILE_DONE, MPI_COMM_WORLD);
+        struct timespec ts = { pauseUs / 1000000, (pauseUs % 1000000) * 1000 };
+        nanosleep(&ts, NULL);
+        if (pauseUs < config.idleMaxUs) {
+            pauseUs = 2 * pauseUs < config.idleMaxUs ? 2 * pauseUs : config.idleMaxUs;
         }
     }
-
-    // TAG_ALL_DONE
-    MPI_Send(NULL, 0, MPI_BYTE, TRACKER_RANK, TAG_ALL_DONE,MPI_COMM_WORLD);
-    c->downloadFinished = 1;
-    return NULL;
 }
 
 void tracker(int numtasks, int rank)
 {
-    Tracker tfiles[MAX_FILES];
-    int count = 0;
-    int doneClients[MAX_CLIENTS];
-    memset(doneClients, 0, sizeof(doneClients));
-    // init
-    for (int c = 1; c < numtasks; c++) {
-        MPI_Status st;
-        int numHave;
-        // waits initial message of each client which contains the list of owned files
-        MPI_Recv(&numHave, 1, MPI_INT, c, TAG_INIT_FILES, MPI_COMM_WORLD, &st);
-
-        for (int i = 0; i < numHave; i++) {
-            char fname[MAX_FILENAME + 1];
-            int segCount;
-            MPI_Recv(fname, MAX_FILENAME + 1, MPI_CHAR, c, TAG_INIT_FILES, MPI_COMM_WORLD, &st);
-            MPI_Recv(&segCount, 1, MPI_INT, c, TAG_INIT_FILES, MPI_COMM_WORLD, &st);
-
-            // search for the file
-            int found = -1;
-            for(int i = 0; i < count; i++) {
-                if (strcmp(tfiles[i].filename, fname) == 0) {
-                    found = i;
-                    break;
-                }
-            }
-            if (found < 0) {
-                int new = count++;
-                found = new;
-                memset(&tfiles[found], 0, sizeof(Tracker));
-                strncpy(tfiles[found].filename, fname, MAX_FILENAME);
-                tfiles[found].seedCount = 0;
-                tfiles[found].numSegments = segCount;
-            }
-            // hashes
-            for (int s = 0; s < segCount; s++) {
-                char segHash[HASH_SIZE + 1];
-                MPI_Recv(segHash, HASH_SIZE+1, MPI_CHAR, c, TAG_INIT_FILES, MPI_COMM_WORLD,&st);
-                // save in tfiles[found]
-                strcpy(tfiles[found].hashes[s], segHash);
-            }
-
-            // add client to seeds
-            int check = 0;
-            for(int s = 0; s < tfiles[found].seedCount; s++) {
-                if (tfiles[found].seeds[s] == c) {
-                    check = 1;
-                    break;
-                }
-            }
-            if (check == 0) {
-                tfiles[found].seeds[tfiles[found].seedCount++] = c;
-            }
-        }
-        // ack
-        char ack[4] = "ACK";
-        MPI_Send(ack,4, MPI_CHAR, c, TAG_INIT_ACK, MPI_COMM_WORLD);
-    }
+    TRACE_ROLE('T');
+    Catalog cat;
+    catalogInit(&cat, numtasks);
+    int* doneClients = (int*)calloc(numtasks, sizeof(int));
+    DIE(doneClients == NULL, "calloc() failed!\n");
+    // TAG_SWARM_PUSH messages sent to every client
+    int* pushed = (int*)calloc(numtasks, sizeof(int));
+    DIE(pushed == NULL, "calloc() failed!\n");
+    // TAG_FILE_DONE sent to each tracker by the clients done here, then by all of them
+    int* doneSent = (int*)calloc(2 * config.trackers, sizeof(int));
+    DIE(doneSent == NULL, "calloc() failed!\n");
+    int* doneTotal = doneSent + config.trackers;
+    // clients are registered in the order their TAG_INIT_FILES arrive, by the main loop
+    int clients = numtasks - config.trackers;
+    int registered = 0;
+    Waiter* waiters = NULL;
+    int waiterCount = 0;
+    int waiterCapacity = 0;
 
     // start analyzing mesages from client
+    int homeClients = 0;
+    for (int c = config.trackers; c < numtasks; c++) {
+        homeClients += homeTracker(c) == rank;
+    }
     int finished = 0;
+    int doneReceived = 0;
+    // once its own clients are done a tracker adds its doneSent to the others'; the swarm is
+    // finished when the reduction is over and every TAG_FILE_DONE counted in it has arrived
+    MPI_Request reduction = MPI_REQUEST_NULL;
+    int reducing = 0;
+    int reduced = 0;
     while (1) {
+        if (finished == homeClients && !reducing) {
+            MPI_Iallreduce(doneSent, doneTotal, config.trackers, MPI_INT, MPI_SUM, trackerComm, &reduction);
+            reducing = 1;
+        }
+        if (reduced && doneReceived == doneTotal[rank]) {
+            break;
+        }
         MPI_Status st;
-        MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
+        if (!reducing || reduced) {
+            MPI_Probe(MPI_ANY_SOURCE, MPI_ANY_TAG, swarmComm, &st);
+        } else if (!probeOrReduced(&reduction, &st)) {
+            reduced = 1;
+            continue;
+        }
+        METRIC(double handledAt = MPI_Wtime());
         int src = st.MPI_SOURCE;
         int tag = st.MPI_TAG;
 
-        if (tag == TAG_WANT_FILE) {
+        if (tag == TAG_INIT_FILES) {
+            // the list of owned files of a client, ACKed right away
+            int size;
+            MPI_Get_count(&st, MPI_PACKED, &size);
+            char* inventory = (char*)malloc(size > 0 ? size : 1);
+            DIE(inventory == NULL, "malloc() failed!\n");
+            MPI_Recv(inventory, size, MPI_PACKED, src, TAG_INIT_FILES, swarmComm, &st);
+            TRACE('R', src, TAG_INIT_FILES, size);
+            registerFiles(&cat, src, inventory, size, pushed);
+            free(inventory);
+            char ack[4] = "ACK";
+            MPI_Send(ack,4, MPI_CHAR, src, TAG_INIT_ACK, swarmComm);
+            TRACE('S', src, TAG_INIT_ACK, 4);
+            registered++;
+            // answer the waiters whose file is known now, or will never be
+            int kept = 0;
+            for (int i = 0; i < waiterCount; i++) {
+                Tracker* t = catalogFind(&cat, waiters[i].filename);
+                if (t != NULL || registered == clients) {
+                    sendFileInfo(t, waiters[i].filename, waiters[i].rank);
+                } else {
+                    waiters[kept++] = waiters[i];
+                }
+            }
+            waiterCount = kept;
+        } else if (tag == TAG_WANT_FILE) {
             // identify the file
             char fname[MAX_FILENAME+1];
-            MPI_Recv(fname, MAX_FILENAME+1, MPI_CHAR, src, TAG_WANT_FILE, MPI_COMM_WORLD,&st);
+            MPI_Recv(fname, MAX_FILENAME+1, MPI_CHAR, src, TAG_WANT_FILE, swarmComm,&st);
+            TRACE('R', src, TAG_WANT_FILE, MAX_FILENAME + 1);
+            fname[MAX_FILENAME] = '\0';
 
             // search 
-            int found = -1;
-            for (int j = 0; j < count; j++) {
-                if (strcmp(tfiles[j].filename, fname) == 0) {
-                    found = j;
-                    break;
+            Tracker* t = catalogFind(&cat, fname);
+            if (t == NULL && registered < clients) {
+                // a client still to register may have it
+                if (waiterCount == waiterCapacity) {
+                    waiterCapacity = waiterCapacity ? 2 * waiterCapacity : 16;
+                    waiters = (Waiter*)realloc(waiters, waiterCapacity * sizeof(Waiter));
+                    DIE(waiters == NULL, "realloc() failed!\n");
                 }
-            }
-            // don t have it 
-            if (found < 0) {
-                int zero = 0;
-                MPI_Send(&zero, 1, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
+                waiters[waiterCount].rank = src;
+                strcpy(waiters[waiterCount].filename, fname);
+                waiterCount++;
             } else {
-                //send
-                int segment_count = tfiles[found].numSegments;
-                MPI_Send(&segment_count, 1, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
-                for (int s = 0; s < segment_count; s++) {
-                    MPI_Send(tfiles[found].hashes[s], HASH_SIZE + 1, MPI_CHAR, src, TAG_FILE_INFO, MPI_COMM_WORLD);
-                }
-                int seeds_count = tfiles[found].seedCount;
-                MPI_Send(&seeds_count, 1, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
-                if (seeds_count > 0) {
-                    MPI_Send(tfiles[found].seeds, seeds_count, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
-                }
+                sendFileInfo(t, fname, src);
             }
         }
         else if (tag == TAG_FILE_DONE) {
             // client becomes seed
             char fname[MAX_FILENAME + 1];
-            MPI_Recv(fname, MAX_FILENAME + 1, MPI_CHAR, src, TAG_FILE_DONE, MPI_COMM_WORLD, &st);
+            MPI_Recv(fname, MAX_FILENAME + 1, MPI_CHAR, src, TAG_FILE_DONE, swarmComm, &st);
+            TRACE('R', src, TAG_FILE_DONE, MAX_FILENAME + 1);
+            doneReceived++;
 
-            int found = -1;
-            for (int i = 0; i < count; i++) {
-                if (strcmp(tfiles[i].filename, fname) == 0) {
-                    found = i;
-                    break;
-                }
+            Tracker* t = catalogFind(&cat, fname);
+            // addSeed ignores duplicates
+            if (t != NULL && addSeed(&cat, t, src)) {
+                invalidateInfo(t);
+                t->subscribed[src / 64] &= ~((uint64_t)1 << (src % 64));
+                pushSeed(&cat, t, src, pushed);
             }
-            if (found >= 0) {
-                int duplicate = 0;
-                for (int sc = 0; sc < tfiles[found].seedCount; sc++) {
-                    if(tfiles[found].seeds[sc] == src) {
-                        duplicate = 1;
-                        break;
-                    }
-                }
-                if (duplicate == 0) {
-                    tfiles[found].seeds[tfiles[found].seedCount++] = src;
+        } else if (tag == TAG_ALL_DONE) {
+            // client is done, with the TAG_FILE_DONE it sent to every tracker
+            int* sent = (int*)malloc(config.trackers * sizeof(int));
+            DIE(sent == NULL, "malloc() failed!\n");
+            MPI_Recv(sent, config.trackers, MPI_INT, src, TAG_ALL_DONE, swarmComm, &st);
+            TRACE('R', src, TAG_ALL_DONE, config.trackers * (int)sizeof(int));
+            if (!doneClients[src]) {
+                doneClients[src] = 1;
+                finished++;
+                for (int k = 0; k < config.trackers; k++) {
+                    doneSent[k] += sent[k];
                 }
             }
-        } else if (tag == TAG_ALL_DONE) {
-            // client is done
-            MPI_Recv(NULL, 0, MPI_BYTE, src, TAG_ALL_DONE, MPI_COMM_WORLD, &st);
-            doneClients[src] = 1;
+            free(sent);
         } else if (tag == TAG_WANT_UPDATE) {
-            // same as for TAG_WANT_FILE
+            // filename, the version and number of seeds the client knows, the bitfield of
+            // the segments it has
+            int size;
+            MPI_Get_count(&st, MPI_PACKED, &size);
+            char* request = (char*)malloc(size);
+            DIE(request == NULL, "malloc() failed!\n");
+            MPI_Recv(request, size, MPI_PACKED, src, TAG_WANT_UPDATE, swarmComm, &st);
+            TRACE('R', src, TAG_WANT_UPDATE, size);
+            int pos = 0;
             char fname[MAX_FILENAME + 1];
-            MPI_Recv(fname, MAX_FILENAME + 1, MPI_CHAR, src, TAG_WANT_UPDATE, MPI_COMM_WORLD, &st);
+            MPI_Unpack(request, size, &pos, fname, MAX_FILENAME + 1, MPI_CHAR, MPI_COMM_WORLD);
+            fname[MAX_FILENAME] = '\0';
+            int since, seedsKnown;
+            MPI_Unpack(request, size, &pos, &since, 1, MPI_INT, MPI_COMM_WORLD);
+            MPI_Unpack(request, size, &pos, &seedsKnown, 1, MPI_INT, MPI_COMM_WORLD);
 
             // check for file
-            int found = -1;
-            for (int j = 0; j < count; j++) {
-                if (strcmp(tfiles[j].filename, fname) == 0) {
-                    found = j;
-                    break;
+            Tracker* t = catalogFind(&cat, fname);
+            if (t != NULL) {
+                unsigned char* have = (unsigned char*)malloc(bitfieldBytes(t->numSegments));
+                DIE(have == NULL, "malloc() failed!\n");
+                MPI_Unpack(request, size, &pos, have, bitfieldBytes(t->numSegments), MPI_BYTE, MPI_COMM_WORLD);
+                if (setPeerHave(&cat, t, src, have)) {
+                    invalidateInfo(t);
                 }
+                free(have);
             }
-            if (found < 0) {
-                // send 0 if the file doesn t exist
-                int zero = 0;
-                MPI_Send(&zero, 1, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
+            free(request);
+            // what changed since the client's version, empty if the file doesn t exist
+            int zero = 0;
+            if (t != NULL && (seedsKnown < 0 || seedsKnown > t->seedCount)) {
+                since = seedsKnown = 0;
+            }
+            int replySize = t != NULL ? deltaSize(t, seedsKnown) : 3 * packedSize(1, MPI_INT);
+            char* reply = (char*)malloc(replySize);
+            DIE(reply == NULL, "malloc() failed!\n");
+            int replyPos = 0;
+            if (t != NULL) {
+                packDelta(t, since, seedsKnown, src, reply, replySize, &replyPos);
             } else {
-            // actual list of seeds or peers
-                int seeds_count = tfiles[found].seedCount;
-                MPI_Send(&seeds_count, 1, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
-                if (seeds_count > 0) {
-                    MPI_Send(tfiles[found].seeds, seeds_count, MPI_INT, src, TAG_FILE_INFO, MPI_COMM_WORLD);
+                for (int i = 0; i < 3; i++) {
+                    MPI_Pack(&zero, 1, MPI_INT, reply, replySize, &replyPos, MPI_COMM_WORLD);
                 }
             }
+            MPI_Send(reply, replyPos, MPI_PACKED, src, TAG_FILE_INFO, swarmComm);
+            TRACE('S', src, TAG_FILE_INFO, replyPos);
+            free(reply);
          }
         //  else {
         //     MPI_Recv(NULL, 0, MPI_BYTE, src, tag, MPI_COMM_WORLD, &st);
         // }
-
-        // check , in order to inform the tracker when the process is over
-        finished = 0;
-        for (int c = 1; c < numtasks; c++) {
-            if (doneClients[c]) {
-                finished++;
-            }
-        }
-        if (finished == (numtasks - 1)) {
-            break;
-        }
+        METRIC(metrics.tagCount[tag - TAG_INIT_FILES]++);
+        METRIC(histAdd(&metrics.tagTime[tag - TAG_INIT_FILES], MPI_Wtime() - handledAt));
+    }
+    benchEvent("finish", rank, NULL);
+    // finally from tracker to client, with the number of pushes it was sent
+    for (int c = config.trackers; c < numtasks; c++) { 
+        MPI_Send(&pushed[c], 1, MPI_INT, c, TAG_FINISH, swarmComm);
+        TRACE('S', c, TAG_FINISH, sizeof(int));
     }
-    // finally from tracker to client
-    for (int c = 1; c < numtasks; c++) { 
-        MPI_Send(NULL, 0, MPI_BYTE, c, TAG_FINISH, MPI_COMM_WORLD);
+    if (rank == TRACKER_RANK) {
+        METRIC(writeMetricsReport(numtasks));
+    } else {
+        METRIC(MPI_Send(&metrics, sizeof(Metrics), MPI_BYTE, TRACKER_RANK, TAG_METRICS, trackerComm));
     }
+    catalogFree(&cat);
+    free(doneClients);
+    free(pushed);
+    free(doneSent);
+    free(waiters);
 }
 
 static void peer(int numtasks, int rank)
@@ -563,21 +3544,50 @@ static void peer(int numtasks, int rank)
     if (!cl) {
         return;
         }
+    cl->numtasks = numtasks;
+    cl->doneSent = (int*)calloc(config.trackers, sizeof(int));
+    DIE(cl->doneSent == NULL, "calloc() failed!\n");
+    chokerInit(&cl->choker, numtasks);
+    openStores(cl);
     pthread_create(&download_thread, NULL, download_thread_func, (void*)cl);
     pthread_create(&upload_thread, NULL, upload_thread_func, (void*)cl);
     // waiting for download
     pthread_join(download_thread, NULL);
-    // waiting for final signal from tracker TAG_FINISH
-    while (!cl->final) {
+    // waiting for final signal from every tracker TAG_FINISH
+    int pushes = 0;
+    for (int k = 0; k < config.trackers; k++) {
+        MPI_Message msg;
         MPI_Status status;
-        int flag;
-        MPI_Iprobe(TRACKER_RANK, TAG_FINISH, MPI_COMM_WORLD, &flag, &status);
-        if (flag) {
-            MPI_Recv(NULL, 0, MPI_BYTE, TRACKER_RANK, TAG_FINISH, MPI_COMM_WORLD, &status);
-            cl->final = 1;
-        }
+        int sent;
+        idleMprobe(MPI_ANY_SOURCE, TAG_FINISH, swarmComm, &msg, &status);
+        MPI_Mrecv(&sent, 1, MPI_INT, &msg, &status);
+        TRACE('R', status.MPI_SOURCE, TAG_FINISH, sizeof(int));
+        pushes += sent;
+    }
+    // pushes that came after the downloads ended
+    for (; cl->pushes < pushes; cl->pushes++) {
+        SwarmPush push;
+        MPI_Status status;
+        MPI_Recv(&push, sizeof(push), MPI_BYTE, MPI_ANY_SOURCE, TAG_SWARM_PUSH, swarmComm, &status);
+        TRACE('R', status.MPI_SOURCE, TAG_SWARM_PUSH, sizeof(push));
+    }
+    cl->final = 1;
+    // wake up every upload worker so they can stop
+    for (int i = 0; i < config.uploadWorkers; i++) {
+        MPI_Send(NULL, 0, MPI_BYTE, rank, TAG_SHUTDOWN, segReqComm);
+        TRACE('S', rank, TAG_SHUTDOWN, 0);
     }
     pthread_join(upload_thread, NULL);
+    if (config.rma) {
+        rmaClose(cl);
+    }
+    closeStores(cl);
+    METRIC(MPI_Send(&metrics, sizeof(Metrics), MPI_BYTE, TRACKER_RANK, TAG_METRICS, swarmComm));
+    pthread_rwlock_destroy(&cl->lock);
+    chokerFree(&cl->choker);
+    freeFiles(cl->haveFiles, cl->numFilesHave);
+    free(cl->wantFiles);
+    free(cl->doneSent);
     free(cl);
 }
 
@@ -592,12 +3602,41 @@ int main(int argc, char *argv[]) {
     }
     MPI_Comm_size(MPI_COMM_WORLD, &numtasks);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    loadConfig();
+    // at least one client
+    if (config.trackers >= numtasks) {
+        config.trackers = numtasks > 1 ? numtasks - 1 : 1;
+    }
+    benchEvent("start", rank, NULL);
+#ifdef TEMA2_TRACE
+    traceOpen(rank);
+#endif
+    MPI_Comm_dup(MPI_COMM_WORLD, &swarmComm);
+    MPI_Comm_dup(MPI_COMM_WORLD, &segReqComm);
+    MPI_Comm_dup(MPI_COMM_WORLD, &segRspComm);
+    MPI_Comm_dup(MPI_COMM_WORLD, &payloadComm);
+    MPI_Comm_split(MPI_COMM_WORLD, rank < config.trackers ? 0 : MPI_UNDEFINED, rank, &trackerComm);
+    MPI_Comm_split(MPI_COMM_WORLD, rank >= config.trackers ? 0 : MPI_UNDEFINED, rank, &clientComm);
 
-    if (rank == TRACKER_RANK){
+    if (rank < config.trackers){
         tracker(numtasks, rank);
     } else {
         peer(numtasks, rank);
     }
 
+    if (trackerComm != MPI_COMM_NULL) {
+        MPI_Comm_free(&trackerComm);
+    }
+    if (clientComm != MPI_COMM_NULL) {
+        MPI_Comm_free(&clientComm);
+    }
+    MPI_Comm_free(&payloadComm);
+    MPI_Comm_free(&segRspComm);
+    MPI_Comm_free(&segReqComm);
+    MPI_Comm_free(&swarmComm);
+#ifdef TEMA2_TRACE
+    traceClose();
+#endif
     MPI_Finalize();
+    return 0;
 }